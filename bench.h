@@ -0,0 +1,240 @@
+// bench.h
+// Benchmark mode (-b) of the line renderers.
+//
+// All renderers draw the same named scenarios. A scenario fixes the line
+// count, the length distribution, the line width, antialiasing and the seed,
+// so numbers from different programs are comparable:
+//
+//   -b ecg[:warmup=N][:frames=N][:seed=N][:csv|:json]     -b list shows all
+//
+// The first 'warmup' frames are drawn but not measured (caches, driver
+// shader variants, ring and bin growth), then 'frames' frames are timed from
+// the start of line generation until the frame is done, i.e. flipped or
+// finished on the GPU. On a real display that includes the vblank wait, so
+// use -B headless or a single buffer to measure the renderer alone. At the
+// end one record with min, median and p99 frame time and lines/s and
+// pixels/s at the median is printed, as CSV (header and row) or one JSON
+// object, and the program exits. run-bench.sh runs every renderer over
+// every scenario and collects the records.
+//
+// Pixels are counted from the geometry, not by the renderers: a line covers
+// max(|dx|, |dy|) + 1 pixels times its width.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "fast-rand.h"
+
+enum { LENGTH_RANDOM, LENGTH_SHORT, LENGTH_SPAN };
+
+typedef struct {
+   const char *name;
+   int lines;           // per frame
+   int length;          // LENGTH_*
+   int max_length;      // LENGTH_SHORT: |dx| and |dy| up to this many pixels
+   float width;         // line width in pixels
+   int aa;              // antialiased edges
+   const char *about;
+} bench_scenario_t;
+
+static const bench_scenario_t bench_scenarios[] = {
+   { "random",    100000, LENGTH_RANDOM,  0, 1.0f, 0, "endpoints anywhere on screen, the default workload" },
+   { "ecg",       100000, LENGTH_SHORT,  16, 1.0f, 0, "short segments, like a dense ECG trace" },
+   { "ecg-wide",  100000, LENGTH_SHORT,  16, 3.0f, 0, "ecg, 3 pixels wide" },
+   { "ecg-aa",    100000, LENGTH_SHORT,  16, 1.5f, 1, "ecg, 1.5 pixels wide, antialiased" },
+   { "span",       10000, LENGTH_SPAN,    0, 1.0f, 0, "edge to edge across the screen" },
+   { "span-wide",  10000, LENGTH_SPAN,    0, 4.0f, 0, "span, 4 pixels wide" },
+   { "span-aa",    10000, LENGTH_SPAN,    0, 2.0f, 1, "span, 2 pixels wide, antialiased" },
+};
+
+#define BENCH_SCENARIOS ((int)(sizeof(bench_scenarios) / sizeof(bench_scenarios[0])))
+
+// the interactive workload of all programs
+#define BENCH_DEFAULT (&bench_scenarios[0])
+
+#define BENCH_USAGE "scenario[:warmup=N][:frames=N][:seed=N][:csv|:json]|list"
+
+typedef struct {
+   const bench_scenario_t *scenario;   // NULL: not benchmarking
+   int warmup;
+   int frames;
+   uint64_t seed;
+   int json;
+
+   const char *program;    // argv[0]
+   char renderer[64];      // set by the program, e.g. "shadow n=3", no commas
+
+   int frame;              // frames drawn, warmup included
+   double *seconds;        // [frames]
+   double pixels;          // summed over the measured frames
+} bench_t;
+
+// Parses a -b argument; returns 0 if it is not valid. "list" prints the
+// scenarios and exits.
+static int bench_parse(bench_t *b, const char *arg)
+{
+   if (!strcmp(arg, "list")) {
+      for (int i = 0; i < BENCH_SCENARIOS; i++)
+         printf("%-10s %6d lines  %s\n", bench_scenarios[i].name,
+                bench_scenarios[i].lines, bench_scenarios[i].about);
+      exit(0);
+   }
+
+   size_t n = strcspn(arg, ":");
+   b->scenario = NULL;
+   for (int i = 0; i < BENCH_SCENARIOS; i++)
+      if (strlen(bench_scenarios[i].name) == n && !strncmp(bench_scenarios[i].name, arg, n))
+         b->scenario = &bench_scenarios[i];
+   if (!b->scenario)
+      return 0;
+
+   b->warmup = 10;
+   b->frames = 100;
+   b->seed = 1;
+   b->json = 0;
+   for (const char *key = arg + n; *key == ':'; key += n) {
+      key++;
+      n = strcspn(key, ":");
+      if      (!strncmp(key, "warmup=", 7))       b->warmup = atoi(key + 7);
+      else if (!strncmp(key, "frames=", 7))       b->frames = atoi(key + 7);
+      else if (!strncmp(key, "seed=", 5))         b->seed = strtoull(key + 5, NULL, 0);
+      else if (n == 3 && !strncmp(key, "csv", 3))  b->json = 0;
+      else if (n == 4 && !strncmp(key, "json", 4)) b->json = 1;
+      else return 0;
+   }
+   if (b->warmup < 0 || b->frames < 1)
+      return 0;
+
+   b->seconds = malloc((size_t)b->frames * sizeof(double));
+   return 1;
+}
+
+// Exits with status 2 if the renderer cannot draw the scenario: lines wider
+// than max_width, or antialiasing without aa support.
+static void bench_require(const bench_t *b, float max_width, int aa)
+{
+   const bench_scenario_t *s = b->scenario;
+   if (!s || (s->width <= max_width && (!s->aa || aa)))
+      return;
+   fprintf(stderr, "%s (%s): scenario %s needs %.1f pixel%s lines, not supported\n",
+           b->program, b->renderer, s->name, s->width, s->aa ? " antialiased" : "");
+   exit(2);
+}
+
+// Line endpoints p[0..3] = x0 y0 x1 y1 on a width x height screen from four
+// random words. Returns the pixels it covers at width 1.
+static inline int bench_line(const bench_scenario_t *s, const uint32_t *q,
+                             int width, int height, int *p)
+{
+   if (s->length == LENGTH_SPAN) {
+      // across the screen, horizontally or vertically
+      if (q[0] & 1) {
+         p[0] = 0;
+         p[1] = rng_range(q[1], height);
+         p[2] = width - 1;
+         p[3] = rng_range(q[3], height);
+      } else {
+         p[0] = rng_range(q[0], width);
+         p[1] = 0;
+         p[2] = rng_range(q[2], width);
+         p[3] = height - 1;
+      }
+   } else {
+      p[0] = rng_range(q[0], width);
+      p[1] = rng_range(q[1], height);
+      if (s->length == LENGTH_SHORT) {
+         uint32_t range = 2 * s->max_length + 1;
+         p[2] = p[0] + (int)rng_range(q[2], range) - s->max_length;
+         p[3] = p[1] + (int)rng_range(q[3], range) - s->max_length;
+         p[2] = (p[2] < 0) ? 0 : (p[2] > width - 1)  ? width - 1  : p[2];
+         p[3] = (p[3] < 0) ? 0 : (p[3] > height - 1) ? height - 1 : p[3];
+      } else {
+         p[2] = rng_range(q[2], width);
+         p[3] = rng_range(q[3], height);
+      }
+   }
+
+   int dx = (p[2] > p[0]) ? p[2] - p[0] : p[0] - p[2];
+   int dy = (p[3] > p[1]) ? p[3] - p[1] : p[1] - p[3];
+   return ((dx > dy) ? dx : dy) + 1;
+}
+
+// Records one frame: 'seconds' from the start of line generation until the
+// frame is done, 'pixels' covered at width 1. Returns 0 once all frames are
+// measured.
+static int bench_frame(bench_t *b, double seconds, double pixels)
+{
+   int i = b->frame++ - b->warmup;
+   if (i >= 0) {
+      b->seconds[i] = seconds;
+      b->pixels += pixels * b->scenario->width;
+   }
+   return i + 1 < b->frames;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+// Prints the record of the measured frames on stdout.
+static void bench_report(bench_t *b, int screen_width, int screen_height)
+{
+   const bench_scenario_t *s = b->scenario;
+   int n = b->frames;
+   qsort(b->seconds, n, sizeof(double), bench_compare);
+
+   double sum = 0.0;
+   for (int i = 0; i < n; i++) sum += b->seconds[i];
+   double min = b->seconds[0];
+   double median = (n % 2) ? b->seconds[n / 2]
+                           : 0.5 * (b->seconds[n / 2 - 1] + b->seconds[n / 2]);
+   // nearest rank
+   int rank = (99 * n + 99) / 100;
+   double p99 = b->seconds[rank - 1];
+   double lines_per_s  = s->lines / median;
+   double pixels_per_s = b->pixels / n / median;
+
+   const char *program = strrchr(b->program, '/') ? strrchr(b->program, '/') + 1 : b->program;
+
+   if (b->json) {
+      printf("{\"program\": \"%s\", \"renderer\": \"%s\", \"scenario\": \"%s\", "
+             "\"screen\": \"%dx%d\", \"lines\": %d, \"width\": %.1f, \"aa\": %d, "
+             "\"seed\": %" PRIu64 ", \"warmup\": %d, \"frames\": %d, "
+             "\"min_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f, \"mean_ms\": %.3f, "
+             "\"lines_per_s\": %.0f, \"pixels_per_s\": %.0f}\n",
+             program, b->renderer, s->name, screen_width, screen_height, s->lines,
+             s->width, s->aa, b->seed, b->warmup, n,
+             min * 1e3, median * 1e3, p99 * 1e3, sum / n * 1e3, lines_per_s, pixels_per_s);
+   } else {
+      printf("program,renderer,scenario,screen,lines,width,aa,seed,warmup,frames,"
+             "min_ms,median_ms,p99_ms,mean_ms,lines_per_s,pixels_per_s\n");
+      printf("%s,%s,%s,%dx%d,%d,%.1f,%d,%" PRIu64 ",%d,%d,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f\n",
+             program, b->renderer, s->name, screen_width, screen_height, s->lines,
+             s->width, s->aa, b->seed, b->warmup, n,
+             min * 1e3, median * 1e3, p99 * 1e3, sum / n * 1e3, lines_per_s, pixels_per_s);
+   }
+   fflush(stdout);
+}
+
+// The GL part is only compiled where a GLES header was included first.
+#ifdef GL_ES_VERSION_3_0
+// glLineWidth() for the scenario; GL_LINES are never antialiased and wide
+// lines are optional in GLES, so this exits if the driver cannot draw them.
+static inline void bench_gl_line_width(const bench_t *b)
+{
+   GLfloat range[2] = { 1.0f, 1.0f };
+   glGetFloatv(GL_ALIASED_LINE_WIDTH_RANGE, range);
+   bench_require(b, range[1], 0);
+   glLineWidth(b->scenario->width);
+}
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+// display-backend.h
+// Display selection for the KMS and GL programs (-B option).
+//
+//   card           /dev/dri/card0, the board's display (default)
+//   vkms           first card node driven by vkms (modprobe vkms): a virtual
+//                  KMS display with a vblank timer, so modeset and page flips
+//                  run unchanged on machines without a monitor
+//   headless[:WxH] no display at all; the CPU renderers draw into plain memory
+//                  and flips complete at once, the GL programs render into a
+//                  pbuffer on the surfaceless EGL platform (the render node,
+//                  or llvmpipe with LIBGL_ALWAYS_SOFTWARE=1). Default 1920x1080.
+//   /dev/dri/...   any other card node
+//
+// Memory is cached and there is no vblank, so headless numbers measure the
+// renderers, not the scanout path; compare them only with each other.
+
+#ifndef DISPLAY_BACKEND_H
+#define DISPLAY_BACKEND_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+enum { BACKEND_CARD, BACKEND_VKMS, BACKEND_HEADLESS };
+
+typedef struct {
+   int kind;
+   const char *path;     // card node of BACKEND_CARD
+   int width, height;    // size of the BACKEND_HEADLESS target
+} backend_t;
+
+#define BACKEND_DEFAULT ((backend_t){ BACKEND_CARD, "/dev/dri/card0", 1920, 1080 })
+
+#define BACKEND_USAGE "card|vkms|headless[:WxH]|/dev/dri/cardN"
+
+// Parses a -B argument; returns 0 if it is not valid.
+static int backend_parse(backend_t *b, const char *arg)
+{
+   *b = BACKEND_DEFAULT;
+   if (!strcmp(arg, "card"))
+      return 1;
+   if (!strcmp(arg, "vkms")) {
+      b->kind = BACKEND_VKMS;
+      return 1;
+   }
+   if (!strncmp(arg, "headless", 8)) {
+      b->kind = BACKEND_HEADLESS;
+      if (arg[8] == '\0')
+         return 1;
+      return sscanf(arg + 8, ":%dx%d", &b->width, &b->height) == 2 &&
+             b->width > 0 && b->height > 0 && b->width <= 16384 && b->height <= 16384;
+   }
+   if (!strncmp(arg, "/dev/", 5)) {
+      b->path = arg;
+      return 1;
+   }
+   return 0;
+}
+
+// Opens the KMS device of a card or vkms backend; exits if there is none.
+static int backend_open(const backend_t *b)
+{
+   if (b->kind == BACKEND_VKMS) {
+      for (int i = 0; i < 16; i++) {
+         char path[32];
+         snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+         int fd = open(path, O_RDWR | O_CLOEXEC);
+         if (fd < 0) continue;
+
+         drmVersionPtr version = drmGetVersion(fd);
+         int vkms = version && !strcmp(version->name, "vkms");
+         drmFreeVersion(version);
+         if (vkms) return fd;
+         close(fd);
+      }
+      fprintf(stderr, "no vkms device, try: modprobe vkms\n");
+      exit(1);
+   }
+
+   int fd = open(b->path, O_RDWR | O_CLOEXEC);
+   if (fd < 0) {
+      perror(b->path);
+      exit(1);
+   }
+   return fd;
+}
+
+// First connected connector with a mode, and a CRTC to drive it. Uses the
+// CRTC already lit if there is one (encoder_id is 0 on an idle vkms output).
+// Exits with a message instead of crashing when nothing is connected.
+static drmModeConnector *backend_output(int fd, drmModeRes *res, uint32_t *crtc_id)
+{
+   for (int i = 0; res && i < res->count_connectors; i++) {
+      drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[i]);
+      if (!conn) continue;
+      if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0) {
+         drmModeFreeConnector(conn);
+         continue;
+      }
+
+      drmModeEncoder *enc = conn->encoder_id ? drmModeGetEncoder(fd, conn->encoder_id) : NULL;
+      *crtc_id = (enc && enc->crtc_id) ? enc->crtc_id : 0;
+      drmModeFreeEncoder(enc);
+
+      for (int e = 0; e < conn->count_encoders && !*crtc_id; e++) {
+         enc = drmModeGetEncoder(fd, conn->encoders[e]);
+         for (int c = 0; enc && c < res->count_crtcs && !*crtc_id; c++)
+            if (enc->possible_crtcs & (1u << c))
+               *crtc_id = res->crtcs[c];
+         drmModeFreeEncoder(enc);
+      }
+      if (*crtc_id) return conn;
+      drmModeFreeConnector(conn);
+   }
+   fprintf(stderr, "no connected display, use -B vkms or -B headless\n");
+   exit(1);
+}
+
+// The GL part is only compiled where <EGL/egl.h> was included first.
+#ifdef EGL_VERSION_1_4
+#include <EGL/eglext.h>
+
+// Surfaceless EGL display with a pbuffer of the backend size made current.
+// eglSwapBuffers() on a pbuffer does nothing, so callers glFinish() instead
+// of flipping.
+static void backend_egl_headless(const backend_t *b, int es_minor,
+                                 EGLDisplay *display, EGLConfig *config,
+                                 EGLContext *context, EGLSurface *surface)
+{
+   *display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+   if (*display == EGL_NO_DISPLAY || !eglInitialize(*display, 0, 0)) {
+      fprintf(stderr, "no surfaceless EGL platform\n");
+      exit(1);
+   }
+   eglBindAPI(EGL_OPENGL_ES_API);
+
+   EGLint config_attributes[] = {
+      EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+      EGL_RED_SIZE,   8,
+      EGL_GREEN_SIZE, 8,
+      EGL_BLUE_SIZE,  8,
+      EGL_ALPHA_SIZE, 8,
+      EGL_NONE
+   };
+   EGLint num_configs = 0;
+   eglChooseConfig(*display, config_attributes, config, 1, &num_configs);
+
+   *context = eglCreateContext(*display, *config, EGL_NO_CONTEXT,
+                               (EGLint[]){ EGL_CONTEXT_MAJOR_VERSION, 3,
+                                           EGL_CONTEXT_MINOR_VERSION, es_minor, EGL_NONE });
+   *surface = eglCreatePbufferSurface(*display, *config,
+                                      (EGLint[]){ EGL_WIDTH, b->width,
+                                                  EGL_HEIGHT, b->height, EGL_NONE });
+   if (!num_configs || *context == EGL_NO_CONTEXT || *surface == EGL_NO_SURFACE ||
+       !eglMakeCurrent(*display, *surface, *surface, *context)) {
+      fprintf(stderr, "no OpenGL ES 3.%d pbuffer context\n", es_minor);
+      exit(1);
+   }
+   printf("Headless   : %dx%d, %s\n", b->width, b->height, (const char *)glGetString(GL_RENDERER));
+}
+#endif
+
+#endif
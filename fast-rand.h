@@ -0,0 +1,96 @@
+// fast-rand.h
+// Small, lock-free PRNG for the benchmark workload generators.
+//
+// glibc random() takes a global lock and costs more than drawing a short
+// line, so generating 100000 random lines used to dominate "Create Vert".
+// rng_t holds RNG_LANES independent xorshift32 streams; rng_fill() steps
+// all lanes in lockstep, which gcc -O3 turns into NEON/SSE code.
+// Every thread owns its own rng_t, seeded explicitly for reproducible runs.
+
+#ifndef FAST_RAND_H
+#define FAST_RAND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RNG_LANES 8
+
+// lines generated per rng_fill() call by the workload loops
+#define RNG_BATCH 256
+
+typedef struct {
+   uint32_t s[RNG_LANES];
+   unsigned lane;
+} rng_t;
+
+static inline uint64_t rng_splitmix64(uint64_t *x)
+{
+   uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+   return z ^ (z >> 31);
+}
+
+static inline void rng_seed(rng_t *rng, uint64_t seed)
+{
+   for (int l = 0; l < RNG_LANES; l++) {
+      uint32_t v = (uint32_t)rng_splitmix64(&seed);
+      rng->s[l] = v ? v : 0x6C078965u;   // xorshift state must not be 0
+   }
+   rng->lane = 0;
+}
+
+// Seed for sub-stream 'index' of 'seed', e.g. one per frame and block of
+// lines, so results do not depend on which thread generates which block.
+static inline uint64_t rng_stream(uint64_t seed, uint64_t index)
+{
+   uint64_t x = seed ^ (index * 0xD1B54A32D192ED03ull);
+   return rng_splitmix64(&x);
+}
+
+// xorshift32 step plus a multiply so the low bits are usable as well
+static inline uint32_t rng_step(uint32_t *s)
+{
+   uint32_t x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x * 0x2545F491u;
+}
+
+static inline uint32_t rng_next(rng_t *rng)
+{
+   uint32_t v = rng_step(&rng->s[rng->lane]);
+   rng->lane = (rng->lane + 1) % RNG_LANES;
+   return v;
+}
+
+// Fills out[0..n) with random words. Full rounds over all lanes are written
+// lane-interleaved, the tail falls back to rng_next().
+static inline void rng_fill(rng_t *rng, uint32_t *out, size_t n)
+{
+   uint32_t s[RNG_LANES];
+   for (int l = 0; l < RNG_LANES; l++) s[l] = rng->s[l];
+
+   size_t i = 0;
+   for (; i + RNG_LANES <= n; i += RNG_LANES)
+      for (int l = 0; l < RNG_LANES; l++)
+         out[i + l] = rng_step(&s[l]);
+
+   for (int l = 0; l < RNG_LANES; l++) rng->s[l] = s[l];
+
+   // counted down from the remainder: indexing from i lets GCC derive a
+   // bogus trip count from the lane loop (-Waggressive-loop-optimizations)
+   uint32_t *tail = out + i;
+   for (size_t r = n - i; r; r--)
+      *tail++ = rng_next(rng);
+}
+
+// maps a random word to [0, range) without a division
+static inline uint32_t rng_range(uint32_t r, uint32_t range)
+{
+   return (uint32_t)(((uint64_t)r * range) >> 32);
+}
+
+#endif
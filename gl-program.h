@@ -0,0 +1,230 @@
+// gl-program.h
+// Shader program creation with status checks and an on-disk binary cache.
+//
+// Compiling the GLSL is a visible part of cold start on the board. Linked
+// programs are saved with glGetProgramBinary() under $XDG_CACHE_HOME/uno-q-kms
+// (default ~/.cache/uno-q-kms), one file per program, named after a hash of
+// GL_RENDERER, GL_VERSION and the shader sources. The next start loads them
+// with glProgramBinary() and only compiles when that fails, e.g. after a
+// driver update. GL_PROGRAM_CACHE=0 in the environment bypasses the cache.
+// Compile and link errors print the info log and exit.
+
+#ifndef GL_PROGRAM_H
+#define GL_PROGRAM_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <GLES3/gl3.h>
+
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+
+#define PROGRAM_CACHE_MAGIC 0x42504c47u   // "GLPB"
+
+typedef struct {
+    int loaded;         // programs taken from the cache
+    int compiled;       // programs compiled from source
+    double seconds;     // total time spent in create_*program()
+} program_stats_t;
+
+static program_stats_t program_stats;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;    // binaryFormat of glProgramBinary()
+    uint64_t key;
+    uint32_t length;
+    uint32_t pad;
+} program_cache_header_t;
+
+static inline double program_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// FNV-1a over a string including its terminating 0
+static inline uint64_t program_hash(uint64_t h, const char *s)
+{
+    do {
+        h ^= (uint8_t)*s;
+        h *= 0x100000001B3ull;
+    } while (*s++);
+    return h;
+}
+
+// Cache file for 'key' in path[size], 0 if there is no usable cache dir.
+static int program_cache_path(char *path, size_t size, uint64_t key)
+{
+    const char *env = getenv("GL_PROGRAM_CACHE");
+    if (env && !strcmp(env, "0"))
+        return 0;
+
+    int n;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        n = snprintf(path, size, "%s/uno-q-kms", xdg);
+    } else if (home && *home) {
+        n = snprintf(path, size, "%s/.cache", home);
+        mkdir(path, 0755);
+        n = snprintf(path, size, "%s/.cache/uno-q-kms", home);
+    } else {
+        return 0;
+    }
+    if (n < 0 || (size_t)n >= size)
+        return 0;
+    mkdir(path, 0755);
+
+    n += snprintf(path + n, size - n, "/%016llx.bin", (unsigned long long)key);
+    return (size_t)n < size;
+}
+
+static int program_cache_load(GLuint program, const char *path, uint64_t key)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+
+    program_cache_header_t header;
+    void *binary = NULL;
+    int ok = fread(&header, sizeof(header), 1, f) == 1 &&
+             header.magic == PROGRAM_CACHE_MAGIC && header.key == key &&
+             (binary = malloc(header.length)) != NULL &&
+             fread(binary, header.length, 1, f) == 1;
+    fclose(f);
+
+    if (ok) {
+        glProgramBinary(program, header.format, binary, (GLsizei)header.length);
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        ok = status == GL_TRUE;
+    }
+    free(binary);
+    return ok;
+}
+
+// Writes to a temporary file and renames it, so a concurrent start never
+// reads a half-written binary.
+static void program_cache_store(GLuint program, const char *path, uint64_t key)
+{
+    GLint formats = 0, length = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (formats <= 0 || length <= 0)
+        return;
+
+    program_cache_header_t header = { .magic = PROGRAM_CACHE_MAGIC, .key = key };
+    void *binary = malloc(length);
+    GLsizei written = 0;
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &written, &format, binary);
+    header.format = format;
+    header.length = (uint32_t)written;
+
+    char tmp[PATH_MAX + 16];
+    int n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = (written > 0 && n > 0 && (size_t)n < sizeof(tmp)) ? fopen(tmp, "wb") : NULL;
+    if (f) {
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                 fwrite(binary, written, 1, f) == 1;
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(binary);
+}
+
+static GLuint compile_shader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, 0);
+    glCompileShader(shader);
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[4096] = "";
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "shader compile failed:\n%s\n", log);
+        exit(1);
+    }
+    return shader;
+}
+
+// Program from 'count' shader stages, from the cache if possible.
+static GLuint create_program_stages(int count, const GLenum *types, const char *const *sources)
+{
+    double t0 = program_seconds();
+
+    uint64_t key = 0xCBF29CE484222325ull;
+    key = program_hash(key, (const char *)glGetString(GL_RENDERER));
+    key = program_hash(key, (const char *)glGetString(GL_VERSION));
+    for (int i = 0; i < count; i++) {
+        char type[16];
+        snprintf(type, sizeof(type), "%x", types[i]);
+        key = program_hash(key, type);
+        key = program_hash(key, sources[i]);
+    }
+
+    char path[512];
+    int cached = program_cache_path(path, sizeof(path), key);
+
+    GLuint program = glCreateProgram();
+    if (cached && program_cache_load(program, path, key)) {
+        program_stats.loaded++;
+    } else {
+        // a failed glProgramBinary() leaves the program unusable
+        glDeleteProgram(program);
+        program = glCreateProgram();
+
+        GLuint shaders[3];
+        for (int i = 0; i < count; i++) {
+            shaders[i] = compile_shader(types[i], sources[i]);
+            glAttachShader(program, shaders[i]);
+        }
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+        for (int i = 0; i < count; i++)
+            glDeleteShader(shaders[i]);
+
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            char log[4096] = "";
+            glGetProgramInfoLog(program, sizeof(log), NULL, log);
+            fprintf(stderr, "program link failed:\n%s\n", log);
+            exit(1);
+        }
+        if (cached)
+            program_cache_store(program, path, key);
+        program_stats.compiled++;
+    }
+
+    program_stats.seconds += program_seconds() - t0;
+    return program;
+}
+
+static inline GLuint create_program(const char *vs, const char *fs)
+{
+    const GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    const char *sources[] = { vs, fs };
+    return create_program_stages(2, types, sources);
+}
+
+static inline GLuint create_compute_program(const char *cs)
+{
+    const GLenum types[] = { GL_COMPUTE_SHADER };
+    const char *sources[] = { cs };
+    return create_program_stages(1, types, sources);
+}
+
+#endif
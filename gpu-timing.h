@@ -0,0 +1,261 @@
+// gpu-timing.h
+// GPU execution time per frame and CPU/GPU overlap for the GL programs.
+//
+// The CPU stage times only show how long submitting took and how long
+// eglSwapBuffers() or the flip blocked, not when the GPU actually ran. Here
+// every frame's GL commands are bracketed on the GPU:
+//
+//   query  GL_EXT_disjoint_timer_query: glQueryCounterEXT() timestamps before
+//          the first and after the last command of the frame. GPU time is
+//          mapped to CLOCK_MONOTONIC through glGetInteger64v(GL_TIMESTAMP_EXT),
+//          resampled after a disjoint event (frequency change, power state).
+//   fence  everywhere else (or GPU_TIMER=fence in the environment): a
+//          glFenceSync() after the last command. The frame ends when a
+//          gpu_timer_poll() first sees the fence signalled, and starts when
+//          the previous frame ended or at submission, whichever is later.
+//          Resolution is the spacing of the polls, so poll at every stage.
+//
+// Results are collected GPU_TIMER_FRAMES frames later without stalling the
+// pipeline. Each GPU interval goes into the stage timer as its own stage on
+// thread 1, so the Chrome trace (STAGE_TRACE) shows it under the CPU stages,
+// and is intersected with the CPU work intervals of the frames for the
+// report:
+//
+//   CPU Busy   generate, upload and submit per frame
+//   GPU Busy   GPU execution per frame, and its share of the frame time
+//   Overlap    GPU execution while the CPU worked on a frame
+//
+// A GPU busy share near 100% means the frame rate is set by fill/raster
+// work, a CPU share near 100% by generation and upload; neither means the
+// frames wait for presentation (vblank).
+
+#ifndef GPU_TIMING_H
+#define GPU_TIMING_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+#include "stage-timing.h"
+
+#define GPU_TIMER_FRAMES 8
+
+enum { GPU_TIMER_QUERY, GPU_TIMER_FENCE };
+
+typedef struct {
+    int mode;                               // GPU_TIMER_*
+    int stage;                              // stage of the GPU intervals
+    stage_timer_t *st;
+
+    GLuint query[GPU_TIMER_FRAMES][2];      // begin, end timestamp
+    GLsync fence[GPU_TIMER_FRAMES];
+    double cpu_begin[GPU_TIMER_FRAMES];     // CPU work of the frame
+    double cpu_end[GPU_TIMER_FRAMES];
+    double gpu_begin[GPU_TIMER_FRAMES];     // of the resolved frames, CLOCK_MONOTONIC
+    double gpu_end[GPU_TIMER_FRAMES];
+    uint64_t submitted;                     // frames bracketed
+    uint64_t resolved;                      // frames with a result
+    double offset;                          // CLOCK_MONOTONIC - GPU clock, seconds
+    double gpu_last_end;
+
+    // per-frame sums since the last report
+    uint32_t frames;
+    uint32_t disjoint;                      // frames dropped by disjoint events
+    double cpu_busy;
+    double gpu_busy;
+    double overlap;
+    double t_report;
+} gpu_timer_t;
+
+static PFNGLQUERYCOUNTEREXTPROC gpu_glQueryCounterEXT;
+static PFNGLGETQUERYIVEXTPROC gpu_glGetQueryivEXT;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC gpu_glGetQueryObjectui64vEXT;
+
+static int gpu_has_extension(const char *name)
+{
+    const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+    size_t n = strlen(name);
+    for (const char *p = ext; p && (p = strstr(p, name)); p += n)
+        if ((p == ext || p[-1] == ' ') && (p[n] == ' ' || p[n] == '\0'))
+            return 1;
+    return 0;
+}
+
+// CLOCK_MONOTONIC minus GPU time; the tightest of a few reads.
+static double gpu_clock_offset(void)
+{
+    double best = 1e9, offset = 0.0;
+    for (int i = 0; i < 4; i++) {
+        double a = stage_seconds();
+        GLint64 gpu = 0;
+        glGetInteger64v(GL_TIMESTAMP_EXT, &gpu);
+        double b = stage_seconds();
+        if (b - a < best) {
+            best = b - a;
+            offset = 0.5 * (a + b) - gpu * 1e-9;
+        }
+    }
+    return offset;
+}
+
+// Picks timer queries when the context has them with a timestamp counter,
+// fences otherwise. GPU intervals are recorded as 'stage' of 'st'.
+static void gpu_timer_init(gpu_timer_t *gt, stage_timer_t *st, int stage)
+{
+    *gt = (gpu_timer_t){ .mode = GPU_TIMER_FENCE, .stage = stage, .st = st };
+    gt->t_report = stage_seconds();
+
+    const char *env = getenv("GPU_TIMER");
+    if (gpu_has_extension("GL_EXT_disjoint_timer_query") && !(env && !strcmp(env, "fence"))) {
+        gpu_glQueryCounterEXT =
+            (PFNGLQUERYCOUNTEREXTPROC)eglGetProcAddress("glQueryCounterEXT");
+        gpu_glGetQueryivEXT =
+            (PFNGLGETQUERYIVEXTPROC)eglGetProcAddress("glGetQueryivEXT");
+        gpu_glGetQueryObjectui64vEXT =
+            (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+        // the extension allows 0 bits: elapsed time only, no timestamps
+        GLint bits = 0;
+        if (gpu_glQueryCounterEXT && gpu_glGetQueryivEXT && gpu_glGetQueryObjectui64vEXT)
+            gpu_glGetQueryivEXT(GL_TIMESTAMP_EXT, GL_QUERY_COUNTER_BITS_EXT, &bits);
+        if (bits > 0) {
+            gt->mode = GPU_TIMER_QUERY;
+            glGenQueries(2 * GPU_TIMER_FRAMES, &gt->query[0][0]);
+            GLint disjoint;
+            glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);   // clears the flag
+            gt->offset = gpu_clock_offset();
+        }
+    }
+    printf("GPU Timer  : %s\n", gt->mode == GPU_TIMER_QUERY ? "GL_EXT_disjoint_timer_query"
+                                                            : "fence");
+}
+
+// Call right before the first GL command of the frame.
+static inline void gpu_timer_begin(gpu_timer_t *gt)
+{
+    if (gt->mode == GPU_TIMER_QUERY)
+        gpu_glQueryCounterEXT(gt->query[gt->submitted % GPU_TIMER_FRAMES][0], GL_TIMESTAMP_EXT);
+}
+
+static inline double gpu_intersect(double a0, double a1, double b0, double b1)
+{
+    double a = a0 > b0 ? a0 : b0;
+    double b = a1 < b1 ? a1 : b1;
+    return b > a ? b - a : 0.0;
+}
+
+// Every pair of a CPU and a GPU interval is intersected once: here against
+// the CPU intervals already submitted (the frame's own and later ones),
+// in gpu_timer_end() for CPU intervals submitted after this result.
+static void gpu_timer_result(gpu_timer_t *gt, int slot, double g0, double g1)
+{
+    if (g1 < g0) g1 = g0;
+    gt->gpu_begin[slot] = g0;
+    gt->gpu_end[slot] = g1;
+    gt->gpu_last_end = g1;
+    stage_record(gt->st, gt->stage, 1, g0, g1);
+
+    for (uint64_t k = gt->resolved; k < gt->submitted; k++) {
+        int s = (int)(k % GPU_TIMER_FRAMES);
+        gt->overlap += gpu_intersect(gt->cpu_begin[s], gt->cpu_end[s], g0, g1);
+    }
+    gt->frames++;
+    gt->cpu_busy += gt->cpu_end[slot] - gt->cpu_begin[slot];
+    gt->gpu_busy += g1 - g0;
+}
+
+// Collects the frames the GPU has finished; with 'wait' at least the oldest
+// one, blocking. Cheap enough to call between all stages.
+static void gpu_timer_poll(gpu_timer_t *gt, int wait)
+{
+    while (gt->resolved < gt->submitted) {
+        int slot = (int)(gt->resolved % GPU_TIMER_FRAMES);
+
+        if (gt->mode == GPU_TIMER_QUERY) {
+            GLuint available = 0;
+            glGetQueryObjectuiv(gt->query[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available && !wait)
+                return;
+            GLuint64 t0 = 0, t1 = 0;
+            gpu_glGetQueryObjectui64vEXT(gt->query[slot][0], GL_QUERY_RESULT, &t0);
+            gpu_glGetQueryObjectui64vEXT(gt->query[slot][1], GL_QUERY_RESULT, &t1);
+
+            GLint disjoint = 0;
+            glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+            if (disjoint) {
+                // every result in flight is suspect, and the clock moved
+                gt->disjoint += (uint32_t)(gt->submitted - gt->resolved);
+                gt->resolved = gt->submitted;
+                gt->offset = gpu_clock_offset();
+                return;
+            }
+            gpu_timer_result(gt, slot, t0 * 1e-9 + gt->offset, t1 * 1e-9 + gt->offset);
+        } else {
+            GLenum r = glClientWaitSync(gt->fence[slot], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                        wait ? 1000000000 : 0);
+            if (r != GL_ALREADY_SIGNALED && r != GL_CONDITION_SATISFIED && !wait)
+                return;
+            double g1 = stage_seconds();
+            double g0 = gt->cpu_end[slot] > gt->gpu_last_end ? gt->cpu_end[slot]
+                                                              : gt->gpu_last_end;
+            glDeleteSync(gt->fence[slot]);
+            gt->fence[slot] = 0;
+            gpu_timer_result(gt, slot, g0, g1);
+        }
+        gt->resolved++;
+        wait = 0;
+    }
+}
+
+// Call right after the last GL command of the frame, before the swap. The
+// CPU worked on the frame from cpu_begin until now.
+static void gpu_timer_end(gpu_timer_t *gt, double cpu_begin)
+{
+    if (gt->submitted - gt->resolved == GPU_TIMER_FRAMES)
+        gpu_timer_poll(gt, 1);
+
+    int slot = (int)(gt->submitted % GPU_TIMER_FRAMES);
+    if (gt->mode == GPU_TIMER_QUERY)
+        gpu_glQueryCounterEXT(gt->query[slot][1], GL_TIMESTAMP_EXT);
+    else
+        gt->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    gt->cpu_begin[slot] = cpu_begin;
+    gt->cpu_end[slot] = stage_seconds();
+    gt->submitted++;
+
+    uint64_t first = gt->resolved > GPU_TIMER_FRAMES ? gt->resolved - GPU_TIMER_FRAMES : 0;
+    for (uint64_t k = first; k < gt->resolved; k++) {
+        int s = (int)(k % GPU_TIMER_FRAMES);
+        gt->overlap += gpu_intersect(cpu_begin, gt->cpu_end[slot], gt->gpu_begin[s], gt->gpu_end[s]);
+    }
+}
+
+// CPU Busy / GPU Busy / Overlap lines for the frames since the last report.
+static void gpu_timer_report(gpu_timer_t *gt)
+{
+    double now = stage_seconds();
+    if (gt->frames) {
+        double frame = (now - gt->t_report) / gt->frames;
+        double cpu = gt->cpu_busy / gt->frames;
+        double gpu = gt->gpu_busy / gt->frames;
+        printf("CPU Busy   : %.6f sec/frame (%.0f%%) \n", cpu, 100.0 * cpu / frame);
+        printf("GPU Busy   : %.6f sec/frame (%.0f%%)%s \n", gpu, 100.0 * gpu / frame,
+               gt->mode == GPU_TIMER_FENCE ? ", fence estimate" : "");
+        printf("Overlap    : %.6f sec/frame \n", gt->overlap / gt->frames);
+    }
+    if (gt->disjoint)
+        printf("GPU Timer  : %" PRIu32 " frames lost to disjoint events \n", gt->disjoint);
+
+    gt->frames = gt->disjoint = 0;
+    gt->cpu_busy = gt->gpu_busy = gt->overlap = 0.0;
+    gt->t_report = now;
+    if (gt->mode == GPU_TIMER_QUERY)
+        gt->offset = gpu_clock_offset();   // follow clock drift
+}
+
+#endif
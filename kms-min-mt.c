@@ -1,6 +1,16 @@
-// kms-min.c
-// gcc kms-min.c -O3 -o kms-min \
+// kms-min-mt.c
+// gcc kms-min-mt.c -O3 -o kms-min-mt \
 //     $(pkg-config --cflags --libs libdrm) -pthread
+//
+// usage: kms-min-mt [-t threads] [-s seed] [-B card|vkms|headless[:WxH]]
+//                   [-b scenario]
+//        (default: online CPUs, time, card0; backends in display-backend.h,
+//        benchmark scenarios in bench.h)
+//
+// Stage times per thread are kept in histograms and printed every 10 seconds,
+// on SIGUSR1 and on Ctrl-C (stage-timing.h). PERF_COUNTERS=1 adds hardware
+// counters per stage and thread, -DPLOT_COUNTER pixels per thread
+// (perf-counters.h).
 
 #include <fcntl.h>
 #include <stdint.h>
@@ -15,19 +25,22 @@
 #include <xf86drmMode.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include <time.h>
 #include <stdio.h>
 #include <inttypes.h>
 
-uint32_t plot_counter = 0;
+#include "fast-rand.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "line-gen.h"
+#include "stage-timing.h"
+#include "perf-counters.h"
 
-typedef struct {
-   int x0;
-   int y0;
-   int x1;
-   int y1;
-   uint32_t c;
-} line_t;
+// Screen is split into TILE_SIZE x TILE_SIZE tiles. Every tile is owned by
+// exactly one thread, so no two threads ever write the same cache line.
+#define TILE_SIZE 64
 
 typedef struct {
    uint32_t *pixels;
@@ -37,13 +50,80 @@ typedef struct {
    uint32_t size;
 } framebuffer_t;
 
+// inclusive pixel bounds
+typedef struct {
+   int x0;
+   int y0;
+   int x1;
+   int y1;
+} rect_t;
+
+// Tile jobs of one thread. The owner and thieves all claim tiles with an
+// atomic fetch-add on next, so taking work never blocks. One queue per
+// cache line to keep the cursors from false sharing.
+typedef struct {
+   int next;
+   int end;
+} __attribute__((aligned(64))) tile_queue_t;
+
 typedef struct {
    framebuffer_t *fb;
+   const bench_scenario_t *scenario;
    line_t *line_list;
+   int line_count;
+   int threads;
+
+   int tiles_x;
+   int tiles_y;
+   int tile_count;
+
+   uint32_t *bin_count;    // [threads][tile_count], lines per thread and tile, then write cursor
+   uint32_t *bin_start;    // [tile_count + 1], first entry of each tile in bin_lines
+   uint32_t *bin_lines;    // line indices grouped by tile, ascending within a tile
+   uint32_t  bin_capacity;
+   double   *tile_time;    // [tile_count]
+
+   tile_queue_t *queues;   // [threads]
+
+   // block b of frame f is generated from rng_stream(seed, f * blocks + b),
+   // so the lines do not depend on the thread count
+   uint64_t seed;
+   uint64_t frame;
+
+   pthread_barrier_t barrier;
+} renderer_t;
+
+typedef struct {
+   renderer_t *r;
+   struct pool *pool;
+   int id;
    int start;
    int end;
+
+   double t_begin;      // start of the frame on this thread
+   double t_gen;
+   double t_bin;
+   double t_raster;
+   int tiles;
+   int stolen;
+   int64_t pixels;      // covered by the lines this thread generated
+   uint32_t plotted;    // pixels this thread drew, with PLOT_COUNTER
+
+   perf_counters_t perf;
+   rng_t rng;
 } thread_arg_t;
 
+// Worker threads live for the whole run. Each frame the main thread releases
+// them at frame_start and waits for them at frame_done.
+typedef struct pool {
+   renderer_t *r;
+   int threads;
+   pthread_t *tid;
+   thread_arg_t *args;
+   pthread_barrier_t frame_start;
+   pthread_barrier_t frame_done;
+} pool_t;
+
 static inline double get_seconds()
 {
    struct timespec ts;
@@ -51,41 +131,146 @@ static inline double get_seconds()
    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static inline int random_int(int min, int max)
-{
-   return min + (int)(random() % (unsigned)(max - min + 1));
-}
-
 static inline void put_pixel(framebuffer_t *fb, int x, int y, uint32_t argb)
 {
    uint8_t  *base = (uint8_t *)fb->pixels;
    uint32_t *row  = (uint32_t *)(base + (uint64_t)y * fb->pitch);
    row[x] = argb;
+   PLOT_COUNT(1);
 }
 
-static inline void draw_line(framebuffer_t *fb, int x0, int y0, int x1, int y1, uint32_t argb)
+// Bresenham written in major/minor axis form: step i (0..dmaj) of a line is
+// at maj0 + i*smaj, min0 + smin * floor((2*i*dmin + dmaj) / (2*dmaj)).
+// Because any step can be computed directly, drawing can start at the first
+// step inside the clip rectangle instead of walking the line from its start.
+// The result does not depend on the clip, so tiled output equals a full draw.
+typedef struct {
+   int x_major;
+   int maj0, min0;
+   int dmaj, dmin;
+   int smaj, smin;
+   int den;
+} line_setup_t;
+
+static inline line_setup_t line_setup(int x0, int y0, int x1, int y1)
 {
    int dx = (x1 > x0) ? (x1 - x0) : (x0 - x1);
+   int dy = (y1 > y0) ? (y1 - y0) : (y0 - y1);
    int sx = (x0 < x1) ? 1 : -1;
-   int dy = (y1 > y0) ? (y0 - y1) : (y1 - y0);
    int sy = (y0 < y1) ? 1 : -1;
-   int err = dx + dy;
 
-   for(;;) {
-      put_pixel(fb, x0, y0, argb);
-      if (x0 == x1 && y0 == y1) break;
-      int e2 = 2 * err;
-      if (e2 >= dy) { err += dy; x0 += sx; }
-      if (e2 <= dx) { err += dx; y0 += sy; }
+   line_setup_t ls;
+   ls.x_major = dx >= dy;
+   ls.maj0 = ls.x_major ? x0 : y0;
+   ls.min0 = ls.x_major ? y0 : x0;
+   ls.dmaj = ls.x_major ? dx : dy;
+   ls.dmin = ls.x_major ? dy : dx;
+   ls.smaj = ls.x_major ? sx : sy;
+   ls.smin = ls.x_major ? sy : sx;
+   ls.den  = ls.dmaj ? 2 * ls.dmaj : 1;
+   return ls;
+}
+
+// step index of major coordinate m (may lie outside 0..dmaj)
+static inline int line_step(const line_setup_t *ls, int m)
+{
+   return (ls->smaj > 0) ? m - ls->maj0 : ls->maj0 - m;
+}
+
+static inline int line_minor(const line_setup_t *ls, int i)
+{
+   return ls->min0 + ls->smin * (int)((2 * (int64_t)i * ls->dmin + ls->dmaj) / ls->den);
+}
+
+static inline void draw_line(framebuffer_t *fb, const rect_t *clip,
+                             int x0, int y0, int x1, int y1, uint32_t argb)
+{
+   line_setup_t ls = line_setup(x0, y0, x1, y1);
+
+   int maj_lo = ls.x_major ? clip->x0 : clip->y0;
+   int maj_hi = ls.x_major ? clip->x1 : clip->y1;
+   int min_lo = ls.x_major ? clip->y0 : clip->x0;
+   int min_hi = ls.x_major ? clip->y1 : clip->x1;
+
+   // steps whose major coordinate lies inside the clip rectangle
+   int i0 = line_step(&ls, (ls.smaj > 0) ? maj_lo : maj_hi);
+   int i1 = line_step(&ls, (ls.smaj > 0) ? maj_hi : maj_lo);
+   if (i0 < 0) i0 = 0;
+   if (i1 > ls.dmaj) i1 = ls.dmaj;
+   if (i0 > i1) return;
+
+   int64_t num = 2 * (int64_t)i0 * ls.dmin + ls.dmaj;
+   int maj = ls.maj0 + ls.smaj * i0;
+   int min = ls.min0 + ls.smin * (int)(num / ls.den);
+   int err = (int)(num % ls.den);
+
+   for (int i = i0; i <= i1; i++) {
+      if (min >= min_lo && min <= min_hi) {
+         if (ls.x_major) put_pixel(fb, maj, min, argb);
+         else            put_pixel(fb, min, maj, argb);
+      }
+      maj += ls.smaj;
+      err += 2 * ls.dmin;
+      if (err >= ls.den) { err -= ls.den; min += ls.smin; }
    }
 }
 
-framebuffer_t init_framebuffer()
+// Writes the index of every tile the line has a pixel in to tiles[] (room for
+// tiles_x + tiles_y entries) and returns how many there are. Lines are
+// clipped to the screen here; off-screen parts never reach a bin.
+static int line_tiles(const renderer_t *r, const line_t *l, int *tiles)
 {
-   int fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+   line_setup_t ls = line_setup(l->x0, l->y0, l->x1, l->y1);
+
+   int maj_size = ls.x_major ? (int)r->fb->width  : (int)r->fb->height;
+   int min_size = ls.x_major ? (int)r->fb->height : (int)r->fb->width;
+
+   int maj_end = ls.maj0 + ls.smaj * ls.dmaj;
+   int lo = (ls.maj0 < maj_end) ? ls.maj0 : maj_end;
+   int hi = (ls.maj0 < maj_end) ? maj_end : ls.maj0;
+   if (lo < 0) lo = 0;
+   if (hi > maj_size - 1) hi = maj_size - 1;
+
+   int n = 0;
+   for (int t = lo / TILE_SIZE; lo <= hi && t <= hi / TILE_SIZE; t++) {
+      int a = (t * TILE_SIZE > lo) ? t * TILE_SIZE : lo;
+      int b = (t * TILE_SIZE + TILE_SIZE - 1 < hi) ? t * TILE_SIZE + TILE_SIZE - 1 : hi;
+
+      // minor coordinate is monotonic along the line, so the ends of the
+      // major range inside this tile column bound it
+      int ma = line_minor(&ls, line_step(&ls, a));
+      int mb = line_minor(&ls, line_step(&ls, b));
+      int mlo = (ma < mb) ? ma : mb;
+      int mhi = (ma < mb) ? mb : ma;
+      if (mlo < 0) mlo = 0;
+      if (mhi > min_size - 1) mhi = min_size - 1;
+
+      for (int u = mlo / TILE_SIZE; mlo <= mhi && u <= mhi / TILE_SIZE; u++)
+         tiles[n++] = ls.x_major ? u * r->tiles_x + t : t * r->tiles_x + u;
+   }
+   return n;
+}
+
+framebuffer_t init_framebuffer(const backend_t *backend)
+{
+   if (backend->kind == BACKEND_HEADLESS) {
+      uint32_t pitch = backend->width * 4;
+      uint32_t size = pitch * backend->height;
+      framebuffer_t fb_t = {
+          .pixels = aligned_alloc(64, ((size_t)size + 63) & ~(size_t)63),
+          .width = backend->width,
+          .height = backend->height,
+          .pitch  = pitch,
+          .size   = size,
+      };
+      memset(fb_t.pixels, 0, size);
+      return fb_t;
+   }
+
+   int fd = backend_open(backend);
    drmModeRes *res = drmModeGetResources(fd);
-   drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[0]);
-   drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoder_id);
+   uint32_t crtc_id;
+   drmModeConnector *conn = backend_output(fd, res, &crtc_id);
    drmModeModeInfo mode = conn->modes[0];
 
    struct drm_mode_create_dumb creq = {0};
@@ -96,7 +281,7 @@ framebuffer_t init_framebuffer()
 
    uint32_t fb;
    drmModeAddFB(fd,creq.width, creq.height, 24, 32, creq.pitch, creq.handle, &fb);
-   drmModeSetCrtc(fd, enc->crtc_id, fb, 0, 0, &conn->connector_id, 1, &mode);
+   drmModeSetCrtc(fd, crtc_id, fb, 0, 0, &conn->connector_id, 1, &mode);
 
    struct drm_mode_map_dumb mreq = {0};
    mreq.handle = creq.handle;
@@ -114,63 +299,331 @@ framebuffer_t init_framebuffer()
    return fb_t;
 }
 
-void *worker(void *arg)
+renderer_t init_renderer(framebuffer_t *fb, line_t *line_list, int line_count, int threads)
 {
-   thread_arg_t *a = (thread_arg_t*)arg;
+   renderer_t r = {0};
+   r.fb = fb;
+   r.line_list = line_list;
+   r.line_count = line_count;
+   r.threads = threads;
+
+   r.tiles_x = (fb->width  + TILE_SIZE - 1) / TILE_SIZE;
+   r.tiles_y = (fb->height + TILE_SIZE - 1) / TILE_SIZE;
+   r.tile_count = r.tiles_x * r.tiles_y;
+
+   r.bin_count = calloc((size_t)threads * r.tile_count, sizeof(uint32_t));
+   r.bin_start = calloc((size_t)r.tile_count + 1, sizeof(uint32_t));
+   r.tile_time = calloc((size_t)r.tile_count, sizeof(double));
+   r.queues = aligned_alloc(64, (size_t)threads * sizeof(tile_queue_t));
+
+   pthread_barrier_init(&r.barrier, NULL, threads);
+   return r;
+}
+
+// Runs on one thread (all others wait at the barrier): turns the per-thread
+// counts into write cursors. Cursors run in thread order inside each tile, and
+// thread slices are in line order, so every bin ends up sorted by line index
+// and pixels shared by several lines get the same color as in a serial draw.
+static void bin_prefix(renderer_t *r)
+{
+   uint32_t offset = 0;
+   for (int tile = 0; tile < r->tile_count; tile++) {
+      r->bin_start[tile] = offset;
+      for (int t = 0; t < r->threads; t++) {
+         uint32_t *c = &r->bin_count[(size_t)t * r->tile_count + tile];
+         uint32_t n = *c;
+         *c = offset;
+         offset += n;
+      }
+   }
+   r->bin_start[r->tile_count] = offset;
 
+   if (offset > r->bin_capacity) {
+      free(r->bin_lines);
+      r->bin_capacity = offset + offset / 4;
+      r->bin_lines = malloc((size_t)r->bin_capacity * sizeof(uint32_t));
+   }
+
+   // each thread starts on a contiguous block of tile rows
+   for (int t = 0; t < r->threads; t++) {
+      r->queues[t].next = (int)((int64_t)r->tile_count * t / r->threads);
+      r->queues[t].end  = (int)((int64_t)r->tile_count * (t + 1) / r->threads);
+   }
+}
+
+// Next tile for thread id: own queue first, then steal from the others.
+static int next_tile(renderer_t *r, int id, int *stolen)
+{
+   for (int k = 0; k < r->threads; k++) {
+      tile_queue_t *q = &r->queues[(id + k) % r->threads];
+      if (__atomic_load_n(&q->next, __ATOMIC_RELAXED) >= q->end)
+         continue;
+      int tile = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+      if (tile < q->end) {
+         if (k) (*stolen)++;
+         return tile;
+      }
+   }
+   return -1;
+}
+
+enum { STAGE_GENERATE, STAGE_BIN, STAGE_RASTER, STAGE_FRAME, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+   "generate (per thread)", "bin (per thread)", "raster (per thread)", "frame",
+};
+
+static void render_frame(thread_arg_t *a)
+{
+   renderer_t *r = a->r;
+   framebuffer_t *fb = r->fb;
+   uint32_t *count = &r->bin_count[(size_t)a->id * r->tile_count];
+   int tiles[r->tiles_x + r->tiles_y];
+
+   double t0 = get_seconds();
+   perf_mark(&a->perf, -1);
+
+   // slices start on RNG_BATCH boundaries, see init_pool()
+   uint64_t blocks = (r->line_count + RNG_BATCH - 1) / RNG_BATCH;
+   a->pixels = 0;
+   for (int i = a->start; i < a->end; i += RNG_BATCH) {
+      int n = (a->end - i < RNG_BATCH) ? a->end - i : RNG_BATCH;
+      rng_seed(&a->rng, rng_stream(r->seed, r->frame * blocks + i / RNG_BATCH));
+      a->pixels += generate_lines(&a->rng, r->scenario, &r->line_list[i], n,
+                                  fb->width, fb->height);
+   }
+
+   perf_mark(&a->perf, STAGE_GENERATE);
+   double t1 = get_seconds();
+
+   // binning pass 1: count lines per tile for this thread's slice
+   memset(count, 0, (size_t)r->tile_count * sizeof(uint32_t));
    for (int i = a->start; i < a->end; i++) {
-      a->line_list[i].x0 = random_int(0, a->fb->width-1);
-      a->line_list[i].y0 = random_int(0, a->fb->height-1);
-      a->line_list[i].x1 = random_int(0, a->fb->width-1);
-      a->line_list[i].y1 = random_int(0, a->fb->height-1);
-      a->line_list[i].c  = 0xFF000000u | (random() & 0x00FFFFFFu);
+      int n = line_tiles(r, &r->line_list[i], tiles);
+      for (int k = 0; k < n; k++)
+         count[tiles[k]]++;
    }
 
+   if (pthread_barrier_wait(&r->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+      bin_prefix(r);
+   pthread_barrier_wait(&r->barrier);
+
+   // binning pass 2: scatter line indices into the tile bins
    for (int i = a->start; i < a->end; i++) {
-      draw_line(a->fb,
-                a->line_list[i].x0,
-                a->line_list[i].y0,
-                a->line_list[i].x1,
-                a->line_list[i].y1,
-                a->line_list[i].c);
+      int n = line_tiles(r, &r->line_list[i], tiles);
+      for (int k = 0; k < n; k++)
+         r->bin_lines[count[tiles[k]]++] = (uint32_t)i;
+   }
+
+   pthread_barrier_wait(&r->barrier);
+   perf_mark(&a->perf, STAGE_BIN);
+   double t2 = get_seconds();
+
+   // raster: a tile is drawn completely by whichever thread claims it
+   a->tiles = 0;
+   a->stolen = 0;
+#ifdef PLOT_COUNTER
+   plot_counter = 0;
+#endif
+   for (int tile; (tile = next_tile(r, a->id, &a->stolen)) >= 0; ) {
+      double ts = get_seconds();
+
+      int tx = tile % r->tiles_x;
+      int ty = tile / r->tiles_x;
+      rect_t clip = {
+         .x0 = tx * TILE_SIZE,
+         .y0 = ty * TILE_SIZE,
+         .x1 = tx * TILE_SIZE + TILE_SIZE - 1,
+         .y1 = ty * TILE_SIZE + TILE_SIZE - 1,
+      };
+      if (clip.x1 > (int)fb->width - 1)  clip.x1 = fb->width - 1;
+      if (clip.y1 > (int)fb->height - 1) clip.y1 = fb->height - 1;
+
+      for (uint32_t k = r->bin_start[tile]; k < r->bin_start[tile + 1]; k++) {
+         const line_t *l = &r->line_list[r->bin_lines[k]];
+         draw_line(fb, &clip, l->x0, l->y0, l->x1, l->y1, l->c);
+      }
+
+      r->tile_time[tile] = get_seconds() - ts;
+      a->tiles++;
    }
 
+   perf_mark(&a->perf, STAGE_RASTER);
+   double t3 = get_seconds();
+#ifdef PLOT_COUNTER
+   a->plotted = plot_counter;
+#endif
+   a->t_begin = t0;
+   a->t_gen = t1 - t0;
+   a->t_bin = t2 - t1;
+   a->t_raster = t3 - t2;
+}
+
+void *worker(void *arg)
+{
+   thread_arg_t *a = (thread_arg_t*)arg;
+   pool_t *pool = a->pool;
+
+   // counters only count the thread that opened them
+   perf_open(&a->perf);
+   for (;;) {
+      pthread_barrier_wait(&pool->frame_start);
+      render_frame(a);
+      pthread_barrier_wait(&pool->frame_done);
+   }
    return NULL;
 }
 
-int main()
+pool_t *init_pool(renderer_t *r, int threads)
+{
+   pool_t *pool = calloc(1, sizeof(*pool));
+   pool->r = r;
+   pool->threads = threads;
+   pool->tid = calloc(threads, sizeof(pthread_t));
+   pool->args = calloc(threads, sizeof(thread_arg_t));
+   pthread_barrier_init(&pool->frame_start, NULL, threads + 1);
+   pthread_barrier_init(&pool->frame_done, NULL, threads + 1);
+
+   for (int t = 0; t < threads; t++) {
+      pool->args[t].r = r;
+      pool->args[t].pool = pool;
+      pool->args[t].id = t;
+      // split on whole RNG_BATCH blocks
+      int blocks = (r->line_count + RNG_BATCH - 1) / RNG_BATCH;
+      int start  = (int)((int64_t)blocks * t / threads) * RNG_BATCH;
+      int end    = (int)((int64_t)blocks * (t + 1) / threads) * RNG_BATCH;
+      pool->args[t].start = (start < r->line_count) ? start : r->line_count;
+      pool->args[t].end   = (end   < r->line_count) ? end   : r->line_count;
+      pthread_create(&pool->tid[t], NULL, worker, &pool->args[t]);
+   }
+   return pool;
+}
+
+static void pool_run_frame(pool_t *pool)
+{
+   pthread_barrier_wait(&pool->frame_start);
+   pthread_barrier_wait(&pool->frame_done);
+}
+
+// Counters of every worker; they wait at frame_start while this runs.
+static void print_perf(const pool_t *pool)
+{
+   for (int t = 0; t < pool->threads; t++) {
+      char label[32];
+      snprintf(label, sizeof(label), "thread %d", t + 1);
+      perf_summary(&pool->args[t].perf, label, stage_names, STAGE_RASTER + 1, stdout);
+   }
+}
+
+int main(int argc, char **argv)
 {
-   int line_count = 100000;
+   int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   uint64_t seed = (uint64_t)time(NULL);
+   backend_t backend = BACKEND_DEFAULT;
+   bench_t bench = { .program = argv[0] };
+   int opt;
+   while ((opt = getopt(argc, argv, "t:s:B:b:")) != -1) {
+      switch (opt) {
+      case 't': threads = atoi(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'B':
+         if (!backend_parse(&backend, optarg)) goto usage;
+         break;
+      case 'b':
+         if (!bench_parse(&bench, optarg)) goto usage;
+         break;
+      default:
+      usage:
+         fprintf(stderr, "usage: %s [-t threads] [-s seed] [-B " BACKEND_USAGE "]\n"
+                         "          [-b " BENCH_USAGE "]\n", argv[0]);
+         return 1;
+      }
+   }
+   if (threads < 1) threads = 1;
+
+   const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+   snprintf(bench.renderer, sizeof(bench.renderer), "tiled t=%d", threads);
+   // Bresenham only: 1 pixel wide, no antialiasing
+   bench_require(&bench, 1.0f, 0);
+   if (bench.scenario) seed = bench.seed;
+
+   int line_count = scenario->lines;
    line_t line_list[line_count];
 
-   framebuffer_t fb_t = init_framebuffer();
-   srandom(time(NULL));
+   framebuffer_t fb_t = init_framebuffer(&backend);
+   renderer_t r = init_renderer(&fb_t, line_list, line_count, threads);
+   r.scenario = scenario;
+   r.seed = seed;
+   pool_t *pool = init_pool(&r, threads);
+   printf("Seed       : %" PRIu64 "\n", seed);
 
-   const int THREADS = 5;
-   pthread_t threads[THREADS];
-   thread_arg_t args[THREADS];
+   // Stage times go into histograms, see stage-timing.h; the workers' stages
+   // are recorded after the frame with their thread number (main is 0).
+   stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
 
    while(1)
    {
       double t0 = get_seconds();
 
-      int chunk = line_count / THREADS;
+      pool_run_frame(pool);
+      r.frame++;
 
-      for (int t = 0; t < THREADS; t++) {
-         args[t].fb = &fb_t;
-         args[t].line_list = line_list;
-         args[t].start = t * chunk;
-         args[t].end = (t == THREADS-1) ? line_count : (t+1)*chunk;
-         pthread_create(&threads[t], NULL, worker, &args[t]);
-      }
+      double t1 = get_seconds();
 
-      for (int t = 0; t < THREADS; t++)
-         pthread_join(threads[t], NULL);
+      stage_record(st, STAGE_FRAME, 0, t0, t1);
+      for (int t = 0; t < threads; t++) {
+         const thread_arg_t *a = &pool->args[t];
+         double b0 = a->t_begin, b1 = b0 + a->t_gen, b2 = b1 + a->t_bin;
+         stage_record(st, STAGE_GENERATE, t + 1, b0, b1);
+         stage_record(st, STAGE_BIN, t + 1, b1, b2);
+         stage_record(st, STAGE_RASTER, t + 1, b2, b2 + a->t_raster);
+      }
 
-      double t1 = get_seconds();
+      if (bench.scenario) {
+         int64_t pixels = 0;
+         for (int t = 0; t < threads; t++)
+            pixels += pool->args[t].pixels;
+         if (!bench_frame(&bench, t1 - t0, (double)pixels)) {
+            bench_report(&bench, fb_t.width, fb_t.height);
+            return 0;
+         }
+         continue;
+      }
 
-      printf("Total Time : %.6f sec\n\n", (t1 - t0));
+      int poll = stage_poll(st);
+      if (poll == STAGE_STOP)
+         break;
+      if (poll != STAGE_REPORT)
+         continue;
+
+      // load balance of the last frame
+      double tile_min = r.tile_time[0], tile_max = r.tile_time[0], tile_sum = 0.0;
+      int tile_slowest = 0;
+      for (int tile = 0; tile < r.tile_count; tile++) {
+         double tt = r.tile_time[tile];
+         tile_sum += tt;
+         if (tt < tile_min) tile_min = tt;
+         if (tt > tile_max) { tile_max = tt; tile_slowest = tile; }
+      }
 
-      sleep(1);
+      for (int t = 0; t < threads; t++) {
+         thread_arg_t *a = &pool->args[t];
+#ifdef PLOT_COUNTER
+         printf("Thread %-4d: %d tiles, %d stolen, %" PRIu32 " pixels\n",
+                t + 1, a->tiles, a->stolen, a->plotted);
+#else
+         printf("Thread %-4d: %d tiles, %d stolen\n", t + 1, a->tiles, a->stolen);
+#endif
+      }
+      printf("Tiles      : %dx%d of %dpx, %" PRIu32 " bin entries\n",
+             r.tiles_x, r.tiles_y, TILE_SIZE, r.bin_start[r.tile_count]);
+      printf("Tile Time  : min %.6f  avg %.6f  max %.6f sec (tile %d,%d)\n\n",
+             tile_min, tile_sum / r.tile_count, tile_max,
+             tile_slowest % r.tiles_x, tile_slowest / r.tiles_x);
+      print_perf(pool);
    }
+
+   stage_finish(st);
+   print_perf(pool);
+   return 0;
 }
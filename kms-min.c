@@ -1,6 +1,35 @@
 // kms-min.c
 // gcc kms-min.c -o kms-min \
         $(pkg-config --cflags --libs libdrm)
+//
+// usage: kms-min [-s seed] [-m direct|shadow|compare] [-n buffers] [-d]
+//                [-w random|sweep] [-B card|vkms|headless[:WxH]] [-b scenario]
+//
+//   direct   draw straight into the mapped dumb buffer (default)
+//   shadow   draw into a cached shadow buffer, stream the frame out
+//   compare  draw every frame both ways and print both timings
+//
+//   -n 1     draw into the buffer on screen, one frame per second (default)
+//   -n 2     double buffering, page flip on vblank, runs flat out
+//   -n 3     triple buffering, next frame is drawn while a flip is pending
+//
+//   -d       damage tracking: clear, copy and report to the kernel
+//            (FB_DAMAGE_CLIPS / DirtyFB) only the rectangles that changed
+//
+//   random   100000 random lines, screen redrawn every frame (default)
+//   sweep    ECG-style sweep: only a narrow strip is erased and redrawn,
+//            everything else stays (-m direct with -n 2|3 needs -d)
+//
+//   -B       display backend, see display-backend.h; headless draws into
+//            malloc'd buffers and every flip completes at once
+//
+//   -b       benchmark a scenario from bench.h instead of running forever,
+//            e.g. -b ecg:json -B headless (not with -m compare or -w sweep)
+//
+// Stage times are kept in histograms and printed every 10 seconds, on
+// SIGUSR1 and on Ctrl-C; STAGE_TRACE=file.json also writes a Chrome trace
+// (stage-timing.h). PERF_COUNTERS=1 adds cycles, instructions, cache and
+// branch misses per stage (perf-counters.h); -DPLOT_COUNTER counts pixels.
 #include <fcntl.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
@@ -16,23 +45,81 @@
 #include <time.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/select.h>
 
-uint32_t plot_counter = 0;
+#include "fast-rand.h"
+#include "pixel-ops.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "line-gen.h"
+#include "stage-timing.h"
+#include "perf-counters.h"
 
+#define MAX_BUFFERS 3
+
+#define MAX_DAMAGE 16
+#define DAMAGE_HISTORY (MAX_BUFFERS + 1)
+
+// width of the strip redrawn per frame in sweep mode
+#define SWEEP_STEP 16
+
+// Changed rectangles of one frame in the kernel's FB_DAMAGE_CLIPS format
+// (x2, y2 exclusive). A few merged rectangles are enough for a sweep strip,
+// many random lines simply merge into one big rectangle.
 typedef struct {
-   int x0;
-   int y0;
-   int x1;
-   int y1;
-   uint32_t c;
-} line_t;
+   struct drm_mode_rect rects[MAX_DAMAGE];
+   int count;
+} damage_t;
 
 typedef struct {
-   uint32_t *pixels;
+   damage_t drawn;      // lines and fills of the frame itself
+   damage_t damage;     // everything written: drawn plus cleared
+} frame_damage_t;
+
+typedef struct {
+   uint32_t *pixels;    // render target, scanout or shadow
    uint32_t width;
    uint32_t height;
    uint32_t pitch;
    uint32_t size;
+
+   // The dumb buffer is write-combined (or uncached) on msm, so scattered
+   // pixel stores into it are slow. With a shadow buffer all drawing goes to
+   // cached RAM and present_shadow() streams the result out sequentially.
+   uint32_t *scanout;   // mapped back buffer
+   uint32_t *shadow;    // cached copy with the same pitch, NULL if unused
+
+   // Swapchain of dumb buffers. The frame is drawn into the back buffer and
+   // put on screen with a page flip on vblank, so the visible one is never
+   // touched while it is scanned out. drm_fd is -1 on the headless backend.
+   int drm_fd;
+   uint32_t crtc_id;
+   uint32_t connector_id;
+   drmModeModeInfo mode;
+
+   int buffer_count;
+   uint32_t  fb_id[MAX_BUFFERS];
+   uint32_t *map[MAX_BUFFERS];
+   int front;           // on screen
+   int pending;         // flip queued for the next vblank, -1 if none
+   int back;            // being drawn, -1 if not acquired yet
+   uint32_t flips;      // completed flips
+
+   // Damage tracking. Frames are numbered from 1; buffer_frame[b] is the
+   // frame last presented from buffer b, so frame - buffer_frame[b] is the
+   // age of its contents and the history tells what it is missing.
+   int track_damage;
+   uint32_t frame;
+   uint32_t buffer_frame[MAX_BUFFERS];
+   frame_damage_t cur;
+   frame_damage_t history[DAMAGE_HISTORY];
+
+   // atomic flip with FB_DAMAGE_CLIPS, plane_id 0 if unavailable
+   uint32_t plane_id;
+   uint32_t prop_fb_id;
+   uint32_t prop_damage_clips;
 } framebuffer_t;
 
 static inline double get_seconds()
@@ -42,21 +129,136 @@ static inline double get_seconds()
    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static inline int random_int(int min, int max)
+/* ---------- Damage tracking ---------- */
+
+static inline int64_t rect_area(const struct drm_mode_rect *r)
+{
+   return (int64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+// Adds [x1,x2) x [y1,y2). The rectangle is merged into the existing one that
+// grows least, unless that growth is bigger than the rectangle itself and
+// there is still room for a new entry.
+static void damage_add(damage_t *d, int x1, int y1, int x2, int y2)
 {
-   return min + (int)(random() % (unsigned)(max - min + 1));
+   struct drm_mode_rect n = { x1, y1, x2, y2 };
+   int best = -1;
+   int64_t best_growth = INT64_MAX;
+
+   for (int i = 0; i < d->count; i++) {
+      struct drm_mode_rect u = d->rects[i];
+      if (n.x1 < u.x1) u.x1 = n.x1;
+      if (n.y1 < u.y1) u.y1 = n.y1;
+      if (n.x2 > u.x2) u.x2 = n.x2;
+      if (n.y2 > u.y2) u.y2 = n.y2;
+      int64_t growth = rect_area(&u) - rect_area(&d->rects[i]);
+      if (growth < best_growth) { best_growth = growth; best = i; }
+   }
+
+   if (best >= 0 && (best_growth <= rect_area(&n) || d->count == MAX_DAMAGE)) {
+      struct drm_mode_rect *u = &d->rects[best];
+      if (n.x1 < u->x1) u->x1 = n.x1;
+      if (n.y1 < u->y1) u->y1 = n.y1;
+      if (n.x2 > u->x2) u->x2 = n.x2;
+      if (n.y2 > u->y2) u->y2 = n.y2;
+   } else {
+      d->rects[d->count++] = n;
+   }
+}
+
+static void damage_union(damage_t *d, const damage_t *other)
+{
+   for (int i = 0; i < other->count; i++)
+      damage_add(d, other->rects[i].x1, other->rects[i].y1,
+                    other->rects[i].x2, other->rects[i].y2);
+}
+
+static int64_t damage_pixels(const damage_t *d)
+{
+   int64_t px = 0;
+   for (int i = 0; i < d->count; i++) px += rect_area(&d->rects[i]);
+   return px;
+}
+
+// Frames since the render target last held a presented frame, 0 if unknown.
+// The shadow always holds the previous frame.
+static uint32_t target_age(const framebuffer_t *fb)
+{
+   uint32_t last = (fb->pixels == fb->shadow) ? fb->frame - 1
+                                              : fb->buffer_frame[fb->back];
+   if (last == 0 || fb->frame - last > DAMAGE_HISTORY) return 0;
+   return fb->frame - last;
+}
+
+// Damage of the frames a buffer of the given age has not seen, this one included.
+static damage_t damage_since(const framebuffer_t *fb, uint32_t age)
+{
+   damage_t d = fb->cur.damage;
+   for (uint32_t k = 1; k < age; k++)
+      damage_union(&d, &fb->history[(fb->frame - k) % DAMAGE_HISTORY].damage);
+   return d;
+}
+
+// w pixels from (x, y) to the right, no clipping
+static inline void fill_span(framebuffer_t *fb, int x, int y, int w, uint32_t argb)
+{
+   uint8_t  *base = (uint8_t *)fb->pixels;
+   uint32_t *row  = (uint32_t *)(base + (uint64_t)y * fb->pitch);
+   pixels_fill(row + x, argb, (size_t)w);
+}
+
+// fill without damage bookkeeping, see fill_rect()
+static inline void fill_pixels(framebuffer_t *fb, int x, int y, int w, int h, uint32_t argb)
+{
+   if (x == 0 && (uint32_t)w == fb->width && fb->pitch == fb->width * 4) {
+      // full rows without padding: one contiguous run
+      fill_span(fb, 0, y, w * h, argb);
+   } else {
+      for (int row = y; row < y + h; row++)
+         fill_span(fb, x, row, w, argb);
+   }
+   pixels_fence();
+}
+
+static inline void fill_rect(framebuffer_t *fb, int x, int y, int w, int h, uint32_t argb)
+{
+   if (x < 0) { w += x; x = 0; }
+   if (y < 0) { h += y; y = 0; }
+   if (x + w > (int)fb->width)  w = fb->width - x;
+   if (y + h > (int)fb->height) h = fb->height - y;
+   if (w <= 0 || h <= 0) return;
+
+   if (fb->track_damage) {
+      damage_add(&fb->cur.drawn,  x, y, x + w, y + h);
+      damage_add(&fb->cur.damage, x, y, x + w, y + h);
+   }
+   fill_pixels(fb, x, y, w, h, argb);
 }
 
+// Clears the render target for a full redraw. With damage tracking only what
+// was drawn into it last time gets erased, otherwise the whole screen.
 static inline void clear(framebuffer_t *fb, uint32_t argb)
 {
-   uint8_t *base = (uint8_t *)fb->pixels;
+   uint32_t age = fb->track_damage ? target_age(fb) : 0;
 
-   for (uint32_t y = 0; y < fb->height; y++) {
-      uint32_t *row = (uint32_t *)(base + (uint64_t)y * fb->pitch);
-      for (uint32_t x = 0; x < fb->width; x++) {
-         row[x] = argb;
-      }
+   if (!age) {
+      fill_pixels(fb, 0, 0, fb->width, fb->height, argb);
+      if (fb->track_damage)
+         damage_add(&fb->cur.damage, 0, 0, fb->width, fb->height);
+      return;
+   }
+
+   const damage_t *old = &fb->history[(fb->frame - age) % DAMAGE_HISTORY].drawn;
+   for (int i = 0; i < old->count; i++) {
+      const struct drm_mode_rect *r = &old->rects[i];
+      fill_pixels(fb, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1, argb);
+      damage_add(&fb->cur.damage, r->x1, r->y1, r->x2, r->y2);
    }
+
+   // The damage clips are relative to the frame on screen, not to this
+   // buffer's old frame: lines of the frames in between disappear as well.
+   for (uint32_t k = 1; k < age; k++)
+      damage_union(&fb->cur.damage, &fb->history[(fb->frame - k) % DAMAGE_HISTORY].drawn);
 }
 
 static inline void put_pixel(framebuffer_t *fb, int x, int y, uint32_t argb)
@@ -66,7 +268,7 @@ static inline void put_pixel(framebuffer_t *fb, int x, int y, uint32_t argb)
    uint8_t  *base = (uint8_t *)fb->pixels;
    uint32_t *row  = (uint32_t *)(base + (uint64_t)y * fb->pitch);
    row[x] = argb;
-   plot_counter++;
+   PLOT_COUNT(1);
 }
 
 static inline void draw_line(framebuffer_t *fb, int x0, int y0, int x1, int y1, uint32_t argb)
@@ -77,6 +279,20 @@ static inline void draw_line(framebuffer_t *fb, int x0, int y0, int x1, int y1,
    int sy = (y0 < y1) ? 1 : -1;
    int err = dx + dy;
 
+   if (fb->track_damage) {
+      int bx0 = (x0 < x1) ? x0 : x1, bx1 = (x0 < x1) ? x1 : x0;
+      int by0 = (y0 < y1) ? y0 : y1, by1 = (y0 < y1) ? y1 : y0;
+      damage_add(&fb->cur.drawn,  bx0, by0, bx1 + 1, by1 + 1);
+      damage_add(&fb->cur.damage, bx0, by0, bx1 + 1, by1 + 1);
+   }
+
+   if (dy == 0) {
+      // horizontal: one span
+      fill_span(fb, (x0 < x1) ? x0 : x1, y0, dx + 1, argb);
+      PLOT_COUNT(dx + 1);
+      return;
+   }
+
    for(;;) {
       put_pixel(fb, x0, y0, argb);
       if (x0 == x1 && y0 == y1) break;
@@ -86,81 +302,572 @@ static inline void draw_line(framebuffer_t *fb, int x0, int y0, int x1, int y1,
    }
 }
 
-framebuffer_t init_framebuffer()
+// Creates one dumb buffer, its DRM framebuffer object and a user mapping.
+static uint32_t *create_dumb(int fd, uint32_t width, uint32_t height,
+                             struct drm_mode_create_dumb *creq, uint32_t *fb)
 {
-   // Open DRM device (display controller / DPU)
-   int fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
-   // Query DRM ressources (connectors, encoders, CRTCs)
-   drmModeRes *res = drmModeGetResources(fd);
-   // Select first connected display and its first mode
-   drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[0]);
-   drmModeEncoder *enc =  drmModeGetEncoder(fd, conn->encoder_id);
-   drmModeModeInfo mode = conn->modes[0];
-   // Mode provides >> hdisplay, vdisplay
-
    // GEM = Graphical Execution Manager
    // Create a simple ("dumb") GEM buffer in kernel memory
-   struct drm_mode_create_dumb creq = {0};
-   creq.width = mode.hdisplay;
-   creq.height = mode.vdisplay;
-   creq.bpp = 32;
-   ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+   *creq = (struct drm_mode_create_dumb){0};
+   creq->width = width;
+   creq->height = height;
+   creq->bpp = 32;
+   ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, creq);
    // creq.width / creq.height, creq.pitch >> length of row in bytes
    // creq.size >> size of entire buffer in bytes
    // Create DRM framebuffer object referencing the GEM buffer
-   uint32_t fb;
-   drmModeAddFB(fd,creq.width, creq.height, 24, 32, creq.pitch, creq.handle, &fb);
-   // Bind DRM framebuffer to CRTC and connector
-   drmModeSetCrtc(fd, enc->crtc_id, fb, 0, 0, &conn->connector_id, 1, &mode);
+   drmModeAddFB(fd, creq->width, creq->height, 24, 32, creq->pitch, creq->handle, fb);
 
    // Map GEM buffer into user space
    struct drm_mode_map_dumb mreq = {0};
-   mreq.handle = creq.handle;
+   mreq.handle = creq->handle;
    ioctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
 
-   uint32_t *p = mmap(0, creq.size,PROT_READ|PROT_WRITE, MAP_SHARED, fd, mreq.offset);
+   return mmap(0, creq->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, mreq.offset);
+}
+
+static uint32_t find_property(int fd, uint32_t obj, uint32_t type, const char *name)
+{
+   uint32_t id = 0;
+   drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj, type);
+   for (uint32_t i = 0; props && i < props->count_props && !id; i++) {
+      drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+      if (prop && !strcmp(prop->name, name)) id = prop->prop_id;
+      drmModeFreeProperty(prop);
+   }
+   drmModeFreeObjectProperties(props);
+   return id;
+}
 
-   framebuffer_t  fb_t = {
-       .pixels = (uint32_t *)p,
-       .width = creq.width,
-       .height = creq.height,
-       .pitch  = creq.pitch,
-       .size   = creq.size,
+// Finds the primary plane of our CRTC and its FB_ID / FB_DAMAGE_CLIPS
+// properties, so flips can carry damage clips through the atomic API.
+// plane_id stays 0 without atomic support; flips then use the legacy call.
+static void init_atomic(framebuffer_t *fb, drmModeRes *res)
+{
+   if (drmSetClientCap(fb->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1)) return;
+
+   int crtc_index = -1;
+   for (int i = 0; i < res->count_crtcs; i++)
+      if (res->crtcs[i] == fb->crtc_id) crtc_index = i;
+
+   drmModePlaneRes *planes = drmModeGetPlaneResources(fb->drm_fd);
+   for (uint32_t i = 0; planes && i < planes->count_planes && !fb->plane_id; i++) {
+      drmModePlane *plane = drmModeGetPlane(fb->drm_fd, planes->planes[i]);
+      if (plane && crtc_index >= 0 && (plane->possible_crtcs & (1u << crtc_index))) {
+         drmModeObjectProperties *props =
+            drmModeObjectGetProperties(fb->drm_fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+         for (uint32_t k = 0; props && k < props->count_props; k++) {
+            drmModePropertyRes *prop = drmModeGetProperty(fb->drm_fd, props->props[k]);
+            if (prop && !strcmp(prop->name, "type") &&
+                props->prop_values[k] == DRM_PLANE_TYPE_PRIMARY)
+               fb->plane_id = plane->plane_id;
+            drmModeFreeProperty(prop);
+         }
+         drmModeFreeObjectProperties(props);
+      }
+      drmModeFreePlane(plane);
+   }
+   drmModeFreePlaneResources(planes);
+   if (!fb->plane_id) return;
+
+   fb->prop_fb_id = find_property(fb->drm_fd, fb->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+   fb->prop_damage_clips = find_property(fb->drm_fd, fb->plane_id, DRM_MODE_OBJECT_PLANE,
+                                         "FB_DAMAGE_CLIPS");
+   if (!fb->prop_fb_id || !fb->prop_damage_clips) fb->plane_id = 0;
+}
+
+framebuffer_t init_framebuffer(int buffers, const backend_t *backend)
+{
+   framebuffer_t fb_t = {
+       .drm_fd = -1,
+       .buffer_count = buffers,
+       .front = 0,
+       .pending = -1,
+       .back = -1,
+       .frame = 1,
    };
+
+   if (backend->kind == BACKEND_HEADLESS) {
+      fb_t.width  = backend->width;
+      fb_t.height = backend->height;
+      fb_t.pitch  = fb_t.width * 4;
+      fb_t.size   = fb_t.pitch * fb_t.height;
+      for (int i = 0; i < buffers; i++) {
+         fb_t.map[i] = aligned_alloc(64, ((size_t)fb_t.size + 63) & ~(size_t)63);
+         memset(fb_t.map[i], 0, fb_t.size);
+      }
+      fb_t.pixels  = fb_t.map[0];
+      fb_t.scanout = fb_t.map[0];
+      return fb_t;
+   }
+
+   // Open DRM device (display controller / DPU)
+   int fd = backend_open(backend);
+   // Query DRM ressources (connectors, encoders, CRTCs)
+   drmModeRes *res = drmModeGetResources(fd);
+   // Select first connected display and its first mode
+   drmModeConnector *conn = backend_output(fd, res, &fb_t.crtc_id);
+   drmModeModeInfo mode = conn->modes[0];
+   // Mode provides >> hdisplay, vdisplay
+
+   fb_t.drm_fd = fd;
+   fb_t.connector_id = conn->connector_id;
+   fb_t.mode = mode;
+
+   struct drm_mode_create_dumb creq;
+   for (int i = 0; i < buffers; i++)
+      fb_t.map[i] = create_dumb(fd, mode.hdisplay, mode.vdisplay, &creq, &fb_t.fb_id[i]);
+
+   // Bind DRM framebuffer to CRTC and connector
+   drmModeSetCrtc(fd, fb_t.crtc_id, fb_t.fb_id[0], 0, 0, &fb_t.connector_id, 1, &mode);
+
+   init_atomic(&fb_t, res);
+
+   fb_t.pixels  = fb_t.map[0];
+   fb_t.scanout = fb_t.map[0];
+   fb_t.width   = creq.width;
+   fb_t.height  = creq.height;
+   fb_t.pitch   = creq.pitch;
+   fb_t.size    = creq.size;
    return fb_t;
 }
 
-int main() {
-   int line_count = 100000;
+/* ---------- Swapchain ---------- */
+
+static void page_flip_handler(int fd, unsigned int frame,
+                              unsigned int sec, unsigned int usec,
+                              void *data)
+{
+   (void)fd; (void)frame; (void)sec; (void)usec;
+   framebuffer_t *fb = (framebuffer_t *)data;
+   fb->front = fb->pending;
+   fb->pending = -1;
+   fb->flips++;
+}
+
+static void wait_for_flip(framebuffer_t *fb)
+{
+   drmEventContext ev = {0};
+   ev.version = DRM_EVENT_CONTEXT_VERSION;
+   ev.page_flip_handler = page_flip_handler;
+
+   while (fb->pending >= 0) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(fb->drm_fd, &fds);
+      select(fb->drm_fd + 1, &fds, NULL, NULL, NULL);
+      drmHandleEvent(fb->drm_fd, &ev);
+   }
+}
+
+// Picks a back buffer that is neither on screen nor queued for the next
+// vblank. With two buffers this waits for the pending flip; with three a
+// free buffer is always there and drawing overlaps the flip.
+void acquire_back(framebuffer_t *fb)
+{
+   if (fb->back >= 0) return;
+
+   while (fb->back < 0) {
+      for (int i = 0; i < fb->buffer_count; i++) {
+         if (fb->buffer_count > 1 && (i == fb->front || i == fb->pending)) continue;
+         fb->back = i;
+         break;
+      }
+      if (fb->back < 0) wait_for_flip(fb);
+   }
+
+   fb->scanout = fb->map[fb->back];
+   if (!fb->shadow) fb->pixels = fb->scanout;
+}
+
+// Queues the back buffer for the next vblank. Only one flip can be in
+// flight, so an older one is waited for first. With damage tracking the
+// frame's damage goes along as FB_DAMAGE_CLIPS (atomic flip) or, for the
+// single front buffer, through DirtyFB.
+void page_flip(framebuffer_t *fb)
+{
+   const damage_t *d = &fb->cur.damage;
+
+   if (fb->drm_fd < 0) {
+      // headless: the flip is done as soon as it is queued
+      if (fb->buffer_count > 1) {
+         fb->front = fb->back;
+         fb->flips++;
+      }
+   } else if (fb->buffer_count > 1) {
+      int ret;
+      wait_for_flip(fb);
+      if (fb->track_damage && fb->plane_id) {
+         uint32_t blob = 0;
+         drmModeAtomicReq *req = drmModeAtomicAlloc();
+         drmModeAtomicAddProperty(req, fb->plane_id, fb->prop_fb_id, fb->fb_id[fb->back]);
+         if (d->count &&
+             !drmModeCreatePropertyBlob(fb->drm_fd, d->rects, d->count * sizeof(d->rects[0]), &blob))
+            drmModeAtomicAddProperty(req, fb->plane_id, fb->prop_damage_clips, blob);
+         ret = drmModeAtomicCommit(fb->drm_fd, req,
+                                   DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, fb);
+         drmModeAtomicFree(req);
+         // the commit holds its own reference to the blob
+         if (blob) drmModeDestroyPropertyBlob(fb->drm_fd, blob);
+      } else {
+         ret = drmModePageFlip(fb->drm_fd, fb->crtc_id, fb->fb_id[fb->back],
+                               DRM_MODE_PAGE_FLIP_EVENT, fb);
+      }
+      if (!ret) {
+         fb->pending = fb->back;
+      } else {
+         // no flip event will come for a rejected flip, so waiting for one
+         // would block forever; show the buffer with a blocking modeset
+         static int warned;
+         if (!warned++)
+            fprintf(stderr, "page flip: %s, using drmModeSetCrtc\n", strerror(-ret));
+         if (drmModeSetCrtc(fb->drm_fd, fb->crtc_id, fb->fb_id[fb->back], 0, 0,
+                            &fb->connector_id, 1, &fb->mode)) {
+            perror("drmModeSetCrtc");
+            exit(1);
+         }
+         fb->front = fb->back;
+         fb->flips++;
+      }
+   } else if (fb->track_damage && d->count) {
+      drmModeClip clips[MAX_DAMAGE];
+      for (int i = 0; i < d->count; i++) {
+         clips[i].x1 = d->rects[i].x1;
+         clips[i].y1 = d->rects[i].y1;
+         clips[i].x2 = d->rects[i].x2;
+         clips[i].y2 = d->rects[i].y2;
+      }
+      drmModeDirtyFB(fb->drm_fd, fb->fb_id[0], clips, d->count);
+   }
+
+   // retire this frame's damage into the history
+   fb->history[fb->frame % DAMAGE_HISTORY] = fb->cur;
+   fb->cur = (frame_damage_t){0};
+   fb->buffer_frame[fb->back] = fb->frame;
+   fb->frame++;
+   fb->back = -1;
+}
+
+// Allocates the cached shadow buffer and makes it the render target.
+void init_shadow(framebuffer_t *fb)
+{
+   fb->shadow = aligned_alloc(64, ((size_t)fb->size + 63) & ~(size_t)63);
+   memcpy(fb->shadow, fb->scanout, fb->size);
+   fb->pixels = fb->shadow;
+}
+
+static void copy_rect(framebuffer_t *fb, const struct drm_mode_rect *r)
+{
+   uint32_t stride = fb->pitch / 4;
+   for (int y = r->y1; y < r->y2; y++)
+      pixels_copy(fb->scanout + (size_t)y * stride + r->x1,
+                  fb->shadow  + (size_t)y * stride + r->x1,
+                  (size_t)(r->x2 - r->x1));
+}
+
+// Streams the shadow buffer to the back buffer. With damage tracking only
+// the rectangles changed since that buffer was last presented are copied
+// (with several buffers that is more than this frame's damage).
+// Returns the number of pixels copied.
+int64_t present_shadow(framebuffer_t *fb)
+{
+   uint32_t age = fb->track_damage ? fb->frame - fb->buffer_frame[fb->back] : 0;
+   int64_t px;
+
+   if (!fb->track_damage || !fb->buffer_frame[fb->back] || age > DAMAGE_HISTORY) {
+      pixels_copy(fb->scanout, fb->shadow, (size_t)(fb->pitch / 4) * fb->height);
+      px = (int64_t)fb->width * fb->height;
+   } else {
+      damage_t d = damage_since(fb, age);
+      for (int i = 0; i < d.count; i++)
+         copy_rect(fb, &d.rects[i]);
+      px = damage_pixels(&d);
+   }
+   pixels_fence();
+   return px;
+}
+
+// Direct drawing into a swapchain leaves the back buffer at the frame it last
+// showed. Before a partial redraw it gets everything that changed since then
+// copied from the newest presented buffer. That reads scanout memory, so it
+// is slow, but only the damage is read.
+static void catch_up_back(framebuffer_t *fb)
+{
+   if (fb->shadow || fb->buffer_count == 1) return;
+
+   int src = (fb->pending >= 0) ? fb->pending : fb->front;
+   if (src == fb->back || !fb->buffer_frame[src]) return;
+
+   uint32_t stride = fb->pitch / 4;
+   uint32_t age = fb->frame - fb->buffer_frame[fb->back];
+   if (!fb->buffer_frame[fb->back] || age > DAMAGE_HISTORY) {
+      pixels_copy(fb->scanout, fb->map[src], (size_t)stride * fb->height);
+   } else {
+      // frames after the back buffer's, up to the previous one
+      damage_t d = damage_since(fb, age);
+      for (int i = 0; i < d.count; i++) {
+         const struct drm_mode_rect *r = &d.rects[i];
+         for (int y = r->y1; y < r->y2; y++)
+            pixels_copy(fb->scanout + (size_t)y * stride + r->x1,
+                        fb->map[src] + (size_t)y * stride + r->x1,
+                        (size_t)(r->x2 - r->x1));
+      }
+   }
+   pixels_fence();
+}
+
+// Sweep workload: the strip in front of the sweep position is erased and
+// filled with short lines, the rest of the screen keeps its contents.
+static void draw_sweep(framebuffer_t *fb, rng_t *rng, line_t *line_list, int line_count)
+{
+   int x = (int)((fb->frame * SWEEP_STEP) % fb->width);
+   fill_rect(fb, x, 0, SWEEP_STEP, fb->height, 0xFF000000u);
+
+   generate_lines(rng, BENCH_DEFAULT, line_list, line_count, SWEEP_STEP, fb->height);
+   for (int i = 0; i < line_count; i++) {
+      line_list[i].x0 += x;
+      line_list[i].x1 += x;
+      if (line_list[i].x0 >= (int)fb->width) line_list[i].x0 = fb->width - 1;
+      if (line_list[i].x1 >= (int)fb->width) line_list[i].x1 = fb->width - 1;
+   }
+}
+
+static void draw_lines(framebuffer_t *fb, const line_t *line_list, int line_count)
+{
+   for (int i = 0; i < line_count; i++) {
+     draw_line(fb,line_list[i].x0,line_list[i].y0,
+                  line_list[i].x1,line_list[i].y1,
+                  line_list[i].c);
+   }
+   pixels_fence();
+}
+
+enum { MODE_DIRECT, MODE_SHADOW, MODE_COMPARE };
+
+enum { STAGE_GENERATE, STAGE_ACQUIRE, STAGE_CLEAR, STAGE_DRAW, STAGE_COPY,
+       STAGE_FLIP, STAGE_FRAME, STAGE_DIRECT, STAGE_SHADOW, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+   "generate", "acquire back buffer", "clear", "draw lines", "shadow copy",
+   "flip", "frame", "compare: direct", "compare: shadow",
+};
+
+int main(int argc, char **argv) {
+   uint64_t seed = (uint64_t)time(NULL);
+   int mode = MODE_DIRECT;
+   int buffers = 1;
+   int damage = 0;
+   int sweep = 0;
+   backend_t backend = BACKEND_DEFAULT;
+   bench_t bench = { .program = argv[0] };
+   int opt;
+   while ((opt = getopt(argc, argv, "s:m:n:dw:B:b:")) != -1) {
+      switch (opt) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'm':
+         if      (!strcmp(optarg, "direct"))  mode = MODE_DIRECT;
+         else if (!strcmp(optarg, "shadow"))  mode = MODE_SHADOW;
+         else if (!strcmp(optarg, "compare")) mode = MODE_COMPARE;
+         else goto usage;
+         break;
+      case 'n':
+         buffers = atoi(optarg);
+         if (buffers < 1 || buffers > MAX_BUFFERS) goto usage;
+         break;
+      case 'd': damage = 1; break;
+      case 'w':
+         if      (!strcmp(optarg, "random")) sweep = 0;
+         else if (!strcmp(optarg, "sweep"))  sweep = 1;
+         else goto usage;
+         break;
+      case 'B':
+         if (!backend_parse(&backend, optarg)) goto usage;
+         break;
+      case 'b':
+         if (!bench_parse(&bench, optarg)) goto usage;
+         break;
+      default:
+      usage:
+         fprintf(stderr, "usage: %s [-s seed] [-m direct|shadow|compare] [-n 1-%d] [-d]"
+                         " [-w random|sweep] [-B " BACKEND_USAGE "]\n"
+                         "          [-b " BENCH_USAGE "]\n", argv[0], MAX_BUFFERS);
+         return 1;
+      }
+   }
+   // a partial redraw needs the damage history to bring each buffer up to date
+   if (sweep && mode == MODE_DIRECT && buffers > 1 && !damage) {
+      fprintf(stderr, "-w sweep with -m direct and -n %d needs -d\n", buffers);
+      return 1;
+   }
+   if (bench.scenario && (mode == MODE_COMPARE || sweep)) {
+      fprintf(stderr, "-b needs -m direct or shadow and -w random\n");
+      return 1;
+   }
+
+   const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+   snprintf(bench.renderer, sizeof(bench.renderer), "%s n=%d%s",
+            (mode == MODE_DIRECT) ? "direct" : "shadow", buffers, damage ? " damage" : "");
+   // Bresenham only: 1 pixel wide, no antialiasing
+   bench_require(&bench, 1.0f, 0);
+   if (bench.scenario) seed = bench.seed;
+
+   int line_count = scenario->lines;
    line_t line_list[line_count];
 
-   framebuffer_t fb_t = init_framebuffer();
-   srandom(time(NULL));
-   while(1){
-      clear(&fb_t,0xFF000000u);
-      plot_counter = 0;
+   framebuffer_t fb_t = init_framebuffer(buffers, &backend);
+   if (mode != MODE_DIRECT)
+      init_shadow(&fb_t);
+   fb_t.track_damage = damage && mode != MODE_COMPARE;
+
+   // sweep: same line density as the random workload, but only in the strip
+   int frame_lines = sweep ? (int)((int64_t)line_count * SWEEP_STEP / fb_t.width) : line_count;
+
+   rng_t rng;
+   rng_seed(&rng, seed);
+   printf("Seed       : %" PRIu64 "\n", seed);
+   if (fb_t.track_damage)
+      printf("Damage     : %s\n", (fb_t.drm_fd < 0) ? "tracked, headless"
+                                 : (buffers > 1 && fb_t.plane_id) ? "atomic FB_DAMAGE_CLIPS"
+                                 : (buffers == 1) ? "DirtyFB" : "tracked, legacy flip without clips");
+
+   // Stage times go into histograms, see stage-timing.h. With a swapchain
+   // the loop runs flat out, a single buffer is redrawn once per second.
+   stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+   perf_counters_t pc;
+   perf_open(&pc);
+   double t_report = get_seconds();
+   uint32_t frames = 0, flips_reported = 0;
+   int64_t copied_sum = 0, damage_sum = 0;
 
+   while(1){
       double t0 = get_seconds();
-      for (int i = 0; i < line_count; i++) {
-        line_list[i].x0 = random_int(0, fb_t.width-1);
-        line_list[i].y0 = random_int(0, fb_t.height-1);
-        line_list[i].x1 = random_int(0, fb_t.width-1);
-        line_list[i].y1 = random_int(0, fb_t.height-1);
-        line_list[i].c  =  0xFF000000u | (random() & 0x00FFFFFFu);
-      }
+      perf_mark(&pc, -1);
+      int64_t pixels = 0;
+      if (!sweep)
+         pixels = generate_lines(&rng, scenario, line_list, line_count, fb_t.width, fb_t.height);
+      perf_mark(&pc, STAGE_GENERATE);
       double t1 = get_seconds();
 
-      for (int i = 0; i < line_count; i++) {
-        draw_line(&fb_t,line_list[i].x0,line_list[i].y0,
-                        line_list[i].x1,line_list[i].y1,
-                        line_list[i].c);
+      if (mode == MODE_COMPARE) {
+         // same lines, once straight into scanout, once through the shadow
+         acquire_back(&fb_t);
+         fb_t.pixels = fb_t.scanout;
+         double d0 = get_seconds();
+         perf_mark(&pc, -1);
+         clear(&fb_t,0xFF000000u);
+         draw_lines(&fb_t, line_list, line_count);
+         perf_mark(&pc, STAGE_DIRECT);
+         double d1 = get_seconds();
+
+         fb_t.pixels = fb_t.shadow;
+         clear(&fb_t,0xFF000000u);
+         draw_lines(&fb_t, line_list, line_count);
+         double d2 = get_seconds();
+         present_shadow(&fb_t);
+         perf_mark(&pc, STAGE_SHADOW);
+         double d3 = get_seconds();
+         page_flip(&fb_t);
+         stage_record(st, STAGE_GENERATE, 0, t0, t1);
+         stage_record(st, STAGE_DIRECT, 0, d0, d1);
+         stage_record(st, STAGE_SHADOW, 0, d1, d3);
+         int poll = stage_poll(st);
+         if (poll == STAGE_STOP)
+            break;
+         if (poll == STAGE_REPORT)
+            perf_summary(&pc, "main thread", stage_names, STAGE_COUNT, stdout);
+
+         printf("Create Vert: %.6f sec \n", (t1 - t0));
+         printf("Direct     : %.6f sec \n", (d1 - d0));
+         printf("Shadow     : %.6f sec (draw %.6f + copy %.6f) \n",
+                (d3 - d1), (d2 - d1), (d3 - d2));
+         printf("Speedup    : %.2fx \n\n", (d1 - d0) / (d3 - d1));
+         sleep(1);
+         continue;
       }
+
+      // direct drawing needs the back buffer up front, the shadow only
+      // needs it for the copy, so there the flip wait comes after drawing
+      double w0 = get_seconds();
+      if (mode == MODE_DIRECT) {
+         acquire_back(&fb_t);
+         perf_mark(&pc, STAGE_ACQUIRE);
+      }
+      double tc = get_seconds();
+      if (sweep) {
+         if (mode == MODE_DIRECT) catch_up_back(&fb_t);
+         draw_sweep(&fb_t, &rng, line_list, frame_lines);
+      } else {
+         clear(&fb_t,0xFF000000u);
+      }
+      perf_mark(&pc, STAGE_CLEAR);
+#ifdef PLOT_COUNTER
+      plot_counter = 0;
+#endif
       double t2 = get_seconds();
-      printf("Create Vert: %.6f sec \n", (t1 - t0));
-      printf("Draw Lines : %.6f sec \n", (t2 - t1));
-      printf("Total Time : %.6f sec \n", (t2 - t0));
-      printf("Plot_Counter: %" PRIu32 "\n\n", plot_counter);
+      draw_lines(&fb_t, line_list, frame_lines);
+      perf_mark(&pc, STAGE_DRAW);
+      double t3 = get_seconds();
+      if (mode != MODE_DIRECT) {
+         acquire_back(&fb_t);
+         perf_mark(&pc, STAGE_ACQUIRE);
+      }
+      double t4 = get_seconds();
+      int64_t copied = (mode == MODE_DIRECT) ? 0 : present_shadow(&fb_t);
+      if (mode != MODE_DIRECT) perf_mark(&pc, STAGE_COPY);
+      double t5 = get_seconds();
+      damage_t frame_damage = fb_t.cur.damage;
+      page_flip(&fb_t);
+      perf_mark(&pc, STAGE_FLIP);
+      double t6 = get_seconds();
+      frames++;
+      copied_sum += copied;
+      damage_sum += damage_pixels(&frame_damage);
+
+      stage_record(st, STAGE_GENERATE, 0, t0, t1);
+      if (mode == MODE_DIRECT) stage_record(st, STAGE_ACQUIRE, 0, w0, tc);
+      else                     stage_record(st, STAGE_ACQUIRE, 0, t3, t4);
+      stage_record(st, STAGE_CLEAR, 0, tc, t2);
+      stage_record(st, STAGE_DRAW, 0, t2, t3);
+      if (mode != MODE_DIRECT) stage_record(st, STAGE_COPY, 0, t4, t5);
+      stage_record(st, STAGE_FLIP, 0, t5, t6);
+      stage_record(st, STAGE_FRAME, 0, t0, t6);
 
-      sleep(1);
+      if (bench.scenario) {
+         if (!bench_frame(&bench, t6 - t0, (double)pixels)) {
+            bench_report(&bench, fb_t.width, fb_t.height);
+            return 0;
+         }
+         continue;
+      }
+
+      int poll = stage_poll(st);
+      if (poll == STAGE_STOP)
+         break;
+      if (poll == STAGE_REPORT) {
+         // averages over the frames since the last summary
+         double screen = (double)fb_t.width * fb_t.height;
+         if (mode != MODE_DIRECT)
+            printf("Copy       : %.1f%% of screen \n", 100.0 * copied_sum / frames / screen);
+         if (fb_t.track_damage)
+            printf("Damage     : %.1f%% of screen, %d rects last frame \n",
+                   100.0 * damage_sum / frames / screen, frame_damage.count);
+         printf("Frames/sec : %.2f (%" PRIu32 " flips) \n",
+                frames / (t6 - t_report), fb_t.flips - flips_reported);
+#ifdef PLOT_COUNTER
+         printf("Plot_Counter: %" PRIu32 " last frame \n", plot_counter);
+#endif
+         printf("\n");
+         perf_summary(&pc, "main thread", stage_names, STAGE_COUNT, stdout);
+
+         t_report = t6;
+         frames = 0;
+         flips_reported = fb_t.flips;
+         copied_sum = damage_sum = 0;
+      }
+      if (fb_t.buffer_count == 1) sleep(1);
    }
+
+   stage_finish(st);
+   perf_summary(&pc, "main thread", stage_names, STAGE_COUNT, stdout);
+   return 0;
 }
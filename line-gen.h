@@ -0,0 +1,49 @@
+// line-gen.h
+// Random line workload of the CPU renderers (kms-min, kms-min-mt).
+//
+// Lines are generated into a plain array of endpoints and colors, drawn
+// from the scenario's length distribution (bench.h) with the lock-free
+// generator of fast-rand.h.
+
+#ifndef LINE_GEN_H
+#define LINE_GEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fast-rand.h"
+#include "bench.h"
+
+typedef struct {
+   int x0;
+   int y0;
+   int x1;
+   int y1;
+   uint32_t c;
+} line_t;
+
+// Fills line_list[0..count) with random on-screen lines of the scenario and
+// returns the pixels they cover. Random words are drawn RNG_BATCH lines at a
+// time so rng_fill() can run vectorized.
+static int64_t generate_lines(rng_t *rng, const bench_scenario_t *scenario,
+                              line_t *line_list, int count,
+                              uint32_t width, uint32_t height)
+{
+   uint32_t rnd[5 * RNG_BATCH];
+   int64_t pixels = 0;
+
+   for (int i0 = 0; i0 < count; i0 += RNG_BATCH) {
+      int n = (count - i0 < RNG_BATCH) ? count - i0 : RNG_BATCH;
+      rng_fill(rng, rnd, 5 * (size_t)n);
+      for (int k = 0; k < n; k++) {
+         const uint32_t *q = &rnd[5 * k];
+         int p[4];
+         pixels += bench_line(scenario, q, width, height, p);
+         line_list[i0 + k] = (line_t){ p[0], p[1], p[2], p[3],
+                                       0xFF000000u | (q[4] & 0x00FFFFFFu) };
+      }
+   }
+   return pixels;
+}
+
+#endif
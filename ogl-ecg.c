@@ -0,0 +1,899 @@
+// ogl-ecg.c
+// Multi-lead ECG waveform display with the sample history kept on the GPU.
+//
+// Build:
+// gcc ogl-ecg.c -O2 -o ogl-ecg \
+//         $(pkg-config --cflags --libs egl glesv2 gbm libdrm) -lm -pthread
+//
+// usage: ogl-ecg [-s seed] [-l leads] [-r rate] [-t seconds] [-m trace|batch]
+//                [-L stack|grid] [-g mV] [-c seconds] [-B backend]
+//
+// Raw int16 samples of all leads live in a ring texture. Each frame only
+// the samples that arrived since the last frame are uploaded with
+// glTexSubImage2D(); the vertex shader fetches the visible window with
+// texelFetch() and computes x/y from gl_VertexID, the ring head and the
+// trace transform. CPU work and upload size per frame follow the sample
+// rate, not the number of samples on screen.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <gbm.h>
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+
+#include "fast-rand.h"
+#include "pixel-ops.h"
+#include "gl-program.h"
+#include "display-backend.h"
+#include "stage-timing.h"
+#include "gpu-timing.h"
+
+#define MAX_LEADS 12
+
+// ring texture rows are RING_WIDTH samples wide, GLES3 only guarantees 2048
+#define RING_SHIFT 10
+#define RING_WIDTH (1 << RING_SHIFT)
+
+typedef struct {
+    int drm_fd;
+    int headless;       // -B headless: pbuffer, no KMS
+    int screen_width;
+    int screen_height;
+
+    drmModeModeInfo mode;
+    drmModeConnector *connector;
+
+    int gbm_fd;                 // render node, BOs are imported into drm_fd
+    struct gbm_device  *gbm_device;
+    struct gbm_surface *gbm_surface;
+    struct gbm_bo *previous_bo;
+
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    int did_modeset;
+
+    volatile int flip_done;
+
+    EGLDisplay egl_display;
+    EGLConfig  egl_config;
+    EGLContext egl_context;
+    EGLSurface egl_surface;
+
+    // CPU-drawn dumb buffer on screen until the first GL frame
+    uint32_t placeholder_fb;
+    uint32_t placeholder_handle;
+    void *placeholder_pixels;
+    uint64_t placeholder_size;
+
+    const backend_t *backend;
+    pthread_t kms_thread;
+    int kms_pending;            // kms thread not joined yet
+    double t_launch;
+
+} GraphicsContext;
+
+static inline double get_seconds()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ---------- Pageflip event ---------- */
+
+static void page_flip_handler(int fd, unsigned int frame,
+                              unsigned int sec, unsigned int usec,
+                              void *data)
+{
+    (void)fd; (void)frame; (void)sec; (void)usec;
+    ((GraphicsContext*)data)->flip_done = 1;
+}
+
+static void wait_for_flip(GraphicsContext *gfx)
+{
+    drmEventContext ev = (drmEventContext){0};
+    ev.version = DRM_EVENT_CONTEXT_VERSION;
+    ev.page_flip_handler = page_flip_handler;
+
+    while (!gfx->flip_done) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(gfx->drm_fd, &fds);
+        select(gfx->drm_fd + 1, &fds, NULL, NULL, NULL);
+        drmHandleEvent(gfx->drm_fd, &ev);
+    }
+    gfx->flip_done = 0;
+}
+
+/* ---------- FB caching per GBM BO ---------- */
+
+typedef struct {
+    int drm_fd;
+    uint32_t fb_id;
+    uint32_t handle;    // GEM handle of the imported BO on drm_fd
+} FbData;
+
+static void fbdata_destroy(struct gbm_bo *bo, void *data)
+{
+    (void)bo;
+    FbData *d = (FbData*)data;
+    if (d) {
+        if (d->fb_id) drmModeRmFB(d->drm_fd, d->fb_id);
+        if (d->handle) {
+            struct drm_gem_close close_req = { .handle = d->handle };
+            drmIoctl(d->drm_fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+        }
+        free(d);
+    }
+}
+
+static uint32_t get_or_create_fb(GraphicsContext *gfx, struct gbm_bo *bo)
+{
+    FbData *d = (FbData*)gbm_bo_get_user_data(bo);
+    if (d) return d->fb_id;
+
+    d = (FbData*)calloc(1, sizeof(*d));
+    d->drm_fd = gfx->drm_fd;
+
+    // GBM runs on the render node, its handles mean nothing on the card fd;
+    // pass the BO over as a dma-buf (once per BO, the FB is cached)
+    int prime_fd = gbm_bo_get_fd(bo);
+    int ret = drmPrimeFDToHandle(gfx->drm_fd, prime_fd, &d->handle);
+    close(prime_fd);
+    if (ret) {
+        perror("drmPrimeFDToHandle");
+        exit(1);
+    }
+
+    uint32_t handles[4] = { d->handle, 0, 0, 0 };
+    uint32_t strides[4] = { gbm_bo_get_stride(bo), 0, 0, 0 };
+    uint32_t offsets[4] = { 0, 0, 0, 0 };
+
+    ret = drmModeAddFB2(gfx->drm_fd, gfx->screen_width, gfx->screen_height,
+                            DRM_FORMAT_XRGB8888, handles, strides, offsets,
+                            &d->fb_id, 0);
+    if (ret) {
+        perror("drmModeAddFB2");
+        exit(1);
+    }
+
+    gbm_bo_set_user_data(bo, d, fbdata_destroy);
+    return d->fb_id;
+}
+/* ---------- Startup ---------- */
+
+// Startup runs in two threads so something is on screen as early as possible:
+//   kms thread:  open the card, probe the connector (reads the EDID), draw a
+//                placeholder into a dumb buffer on the CPU and modeset to it
+//   main thread: GBM and EGL on the render node, a context without a surface,
+//                then programs, textures and buffers (see main)
+// graphics_attach() joins the two: it creates the gbm_surface for the probed
+// mode, and the first GL frame replaces the placeholder with a page flip,
+// not a second modeset, so the screen does not go dark in between.
+
+// startup log: duration of a phase and time since launch
+static void init_phase(const GraphicsContext *gfx, const char *name, double t0)
+{
+    double t = get_seconds();
+    printf("Init %-20s %8.2f ms  (at %8.2f ms)\n",
+           name, (t - t0) * 1e3, (t - gfx->t_launch) * 1e3);
+}
+
+// dim ECG paper: minor lines every 8 pixels, major lines every 40
+static void placeholder_draw(uint32_t *pixels, uint32_t pitch, int width, int height)
+{
+    const uint32_t paper = 0x00000000, minor = 0x00181010, major = 0x00382020;
+
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)((uint8_t *)pixels + (uint64_t)y * pitch);
+        if (y % 8 == 0) {
+            pixels_fill(row, (y % 40 == 0) ? major : minor, width);
+            continue;
+        }
+        pixels_fill(row, paper, width);
+        for (int x = 0; x < width; x += 8)
+            row[x] = (x % 40 == 0) ? major : minor;
+    }
+    pixels_fence();
+}
+
+static void *kms_init(void *arg)
+{
+    GraphicsContext *gfx = arg;
+    double t0 = get_seconds();
+
+    gfx->drm_fd = backend_open(gfx->backend);
+    init_phase(gfx, "kms: open device", t0);
+
+    t0 = get_seconds();
+    drmModeRes *resources = drmModeGetResources(gfx->drm_fd);
+    gfx->connector = backend_output(gfx->drm_fd, resources, &gfx->crtc_id);
+    gfx->mode = gfx->connector->modes[0];
+
+    gfx->screen_width  = gfx->mode.hdisplay;
+    gfx->screen_height = gfx->mode.vdisplay;
+
+    gfx->connector_id = gfx->connector->connector_id;
+    drmModeFreeResources(resources);
+    init_phase(gfx, "kms: probe connector", t0);
+
+    t0 = get_seconds();
+    struct drm_mode_create_dumb creq = {0};
+    creq.width  = gfx->screen_width;
+    creq.height = gfx->screen_height;
+    creq.bpp    = 32;
+    if (ioctl(gfx->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+        perror("placeholder: DRM_IOCTL_MODE_CREATE_DUMB");
+        return NULL;
+    }
+
+    struct drm_mode_map_dumb mreq = {0};
+    mreq.handle = creq.handle;
+    ioctl(gfx->drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+    void *pixels = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        gfx->drm_fd, mreq.offset);
+    if (pixels == MAP_FAILED) {
+        perror("placeholder: mmap");
+        return NULL;
+    }
+    placeholder_draw(pixels, creq.pitch, creq.width, creq.height);
+
+    gfx->placeholder_handle = creq.handle;
+    gfx->placeholder_pixels = pixels;
+    gfx->placeholder_size = creq.size;
+    drmModeAddFB(gfx->drm_fd, creq.width, creq.height, 24, 32, creq.pitch,
+                 creq.handle, &gfx->placeholder_fb);
+    init_phase(gfx, "kms: placeholder", t0);
+
+    t0 = get_seconds();
+    if (drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, gfx->placeholder_fb, 0, 0,
+                       &gfx->connector_id, 1, &gfx->mode) == 0)
+        gfx->did_modeset = 1;
+    init_phase(gfx, "kms: modeset", t0);
+    return NULL;
+}
+
+// Waits for the kms thread and makes the window surface for its mode current.
+static void graphics_attach(GraphicsContext *gfx)
+{
+    if (!gfx->kms_pending)
+        return;
+    gfx->kms_pending = 0;
+
+    double t0 = get_seconds();
+    pthread_join(gfx->kms_thread, NULL);
+    init_phase(gfx, "wait for kms", t0);
+
+    t0 = get_seconds();
+    EGLint format;
+    eglGetConfigAttrib(gfx->egl_display, gfx->egl_config, EGL_NATIVE_VISUAL_ID, &format);
+
+    gfx->gbm_surface = gbm_surface_create(
+        gfx->gbm_device,
+        gfx->screen_width,
+        gfx->screen_height,
+        format,
+        GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
+    );
+
+    gfx->egl_surface = eglCreateWindowSurface(
+        gfx->egl_display,
+        gfx->egl_config,
+        (EGLNativeWindowType)gfx->gbm_surface,
+        0
+    );
+
+    eglMakeCurrent(gfx->egl_display,
+                   gfx->egl_surface,
+                   gfx->egl_surface,
+                   gfx->egl_context);
+
+    glViewport(0, 0, gfx->screen_width, gfx->screen_height);
+
+    eglSwapInterval(gfx->egl_display, 0);
+    init_phase(gfx, "egl: window surface", t0);
+}
+
+// Starts the kms thread and sets up GBM and EGL on the render node. The
+// context is current without a surface if the driver supports that
+// (EGL_KHR_surfaceless_context), so GL objects can be created before the
+// mode is known; otherwise this waits for graphics_attach().
+// The headless backend needs neither: a pbuffer is current right away.
+static void graphics_init(GraphicsContext *gfx, const backend_t *backend, double t_launch)
+{
+    *gfx = (GraphicsContext){0};
+    gfx->t_launch = t_launch;
+    gfx->backend = backend;
+
+    if (backend->kind == BACKEND_HEADLESS) {
+        double t0 = get_seconds();
+        gfx->headless = 1;
+        gfx->screen_width  = backend->width;
+        gfx->screen_height = backend->height;
+        backend_egl_headless(backend, 0, &gfx->egl_display, &gfx->egl_config,
+                             &gfx->egl_context, &gfx->egl_surface);
+        glViewport(0, 0, gfx->screen_width, gfx->screen_height);
+        init_phase(gfx, "egl: headless", t0);
+        return;
+    }
+
+    pthread_create(&gfx->kms_thread, NULL, kms_init, gfx);
+    gfx->kms_pending = 1;
+
+    double t0 = get_seconds();
+    // GBM only allocates, it does not need the card node; a second fd of
+    // the display device also works where there is no render node
+    gfx->gbm_fd = open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
+    if (gfx->gbm_fd < 0)
+        gfx->gbm_fd = backend_open(backend);
+    gfx->gbm_device = gbm_create_device(gfx->gbm_fd);
+    init_phase(gfx, "egl: gbm device", t0);
+
+    t0 = get_seconds();
+    gfx->egl_display = eglGetDisplay((EGLNativeDisplayType)gfx->gbm_device);
+    eglInitialize(gfx->egl_display, 0, 0);
+    eglBindAPI(EGL_OPENGL_ES_API);
+    init_phase(gfx, "egl: initialize", t0);
+
+    t0 = get_seconds();
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE,    EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+        EGL_RED_SIZE,   8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE,  8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE
+    };
+
+    EGLint num_configs;
+    eglChooseConfig(gfx->egl_display, config_attributes, &gfx->egl_config, 1, &num_configs);
+
+    gfx->egl_context = eglCreateContext(
+        gfx->egl_display,
+        gfx->egl_config,
+        EGL_NO_CONTEXT,
+        (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
+    );
+    init_phase(gfx, "egl: context", t0);
+
+    if (!eglMakeCurrent(gfx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, gfx->egl_context))
+        graphics_attach(gfx);
+}
+
+// Frees the placeholder once a GL frame is on screen.
+static void placeholder_release(GraphicsContext *gfx)
+{
+    drmModeRmFB(gfx->drm_fd, gfx->placeholder_fb);
+    munmap(gfx->placeholder_pixels, gfx->placeholder_size);
+    struct drm_mode_destroy_dumb dreq = { .handle = gfx->placeholder_handle };
+    ioctl(gfx->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    gfx->placeholder_fb = 0;
+}
+
+static void graphics_present(GraphicsContext *gfx)
+{
+    if (gfx->headless) {
+        // nothing to flip; wait for the GPU as a flip would
+        glFinish();
+        return;
+    }
+
+    // after eglSwapBuffers(): lock next front buffer
+    struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
+    uint32_t new_fb = get_or_create_fb(gfx, new_bo);
+    if (!gfx->did_modeset) {
+        drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, new_fb, 0, 0,
+                       &gfx->connector_id, 1, &gfx->mode);
+        gfx->did_modeset = 1;
+    } else {
+        gfx->flip_done = 0;
+        drmModePageFlip(gfx->drm_fd, gfx->crtc_id, new_fb,
+                        DRM_MODE_PAGE_FLIP_EVENT, gfx);
+        wait_for_flip(gfx);
+    }
+
+    // now safe: release previous BO (FB is freed when BO is destroyed via user_data callback)
+    if (gfx->previous_bo)
+        gbm_surface_release_buffer(gfx->gbm_surface, gfx->previous_bo);
+    if (gfx->placeholder_fb)
+        placeholder_release(gfx);
+
+    gfx->previous_bo = new_bo;
+}
+
+/* ---------- Synthetic ECG source ---------- */
+
+// One wave of the PQRST complex: position in the beat, amplitude in
+// microvolts, width in beats.
+typedef struct {
+    float pos, amp, width;
+} ecg_wave_t;
+
+static const ecg_wave_t ecg_waves[] = {
+    { 0.20f,   150.0f, 0.025f },   // P
+    { 0.37f,  -100.0f, 0.010f },   // Q
+    { 0.40f,  1200.0f, 0.012f },   // R
+    { 0.43f,  -250.0f, 0.010f },   // S
+    { 0.65f,   300.0f, 0.040f },   // T
+};
+
+// rough scale of the complex per lead: I II III aVR aVL aVF V1..V6
+static const float lead_scale[MAX_LEADS] = {
+    0.6f, 1.0f, 0.4f, -0.8f, 0.3f, 0.7f, -0.5f, -0.2f, 0.4f, 1.2f, 1.1f, 0.9f
+};
+
+typedef struct {
+    int leads;
+    int rate;             // samples per second and lead
+    float heart_rate;     // beats per second
+    uint64_t produced;    // samples per lead generated so far
+    double start;         // time of sample 0
+    rng_t rng;
+} ecg_source_t;
+
+// Generates the next n samples of every lead into out[lead * n + i], in
+// microvolts (1 LSB = 1 uV) with a little noise.
+static void ecg_generate(ecg_source_t *src, int16_t *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        double t = (double)(src->produced + i) / src->rate;
+        float phase = (float)fmod(t * src->heart_rate, 1.0);
+
+        float v = 0.0f;
+        for (size_t w = 0; w < sizeof(ecg_waves) / sizeof(ecg_waves[0]); w++) {
+            float d = (phase - ecg_waves[w].pos) / ecg_waves[w].width;
+            v += ecg_waves[w].amp * expf(-0.5f * d * d);
+        }
+
+        for (int l = 0; l < src->leads; l++) {
+            int noise = (int)(rng_next(&src->rng) >> 26) - 32;
+            out[l * n + i] = (int16_t)lrintf(v * lead_scale[l] + noise);
+        }
+    }
+    src->produced += n;
+}
+
+/* ---------- Sample ring texture ---------- */
+
+// All leads' recent samples in one GL_R16I texture. Sample s of lead l is
+// texel (s % RING_WIDTH, (s / RING_WIDTH) * leads + l): the rows of all
+// leads for the same stretch of time are adjacent, so a batch of new
+// samples is a single glTexSubImage2D() per RING_WIDTH boundary crossed.
+typedef struct {
+    GLuint texture;
+    int leads;
+    int size;             // samples per lead, power of two
+    uint64_t head;        // samples per lead written so far
+} sample_ring_t;
+
+static void sample_ring_init(sample_ring_t *ring, int leads, int min_size)
+{
+    *ring = (sample_ring_t){ .leads = leads, .size = RING_WIDTH };
+    while (ring->size < min_size)
+        ring->size *= 2;
+    int height = ring->size / RING_WIDTH * leads;
+
+    glGenTextures(1, &ring->texture);
+    glBindTexture(GL_TEXTURE_2D, ring->texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R16I, RING_WIDTH, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // flat line until the first window is filled
+    int16_t *zero = calloc((size_t)RING_WIDTH * height, sizeof(int16_t));
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RING_WIDTH, height,
+                    GL_RED_INTEGER, GL_SHORT, zero);
+    free(zero);
+}
+
+// Appends n samples per lead from data[lead * n + i].
+static void sample_ring_push(sample_ring_t *ring, const int16_t *data, int n)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, n);
+
+    for (int done = 0; done < n; ) {
+        int index = (int)(ring->head & (uint64_t)(ring->size - 1));
+        int x = index % RING_WIDTH;
+        int row = index / RING_WIDTH;
+        int span = n - done;
+        if (span > RING_WIDTH - x) span = RING_WIDTH - x;
+
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, row * ring->leads, span, ring->leads,
+                        GL_RED_INTEGER, GL_SHORT, data + done);
+        done += span;
+        ring->head += span;
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+/* ---------- Polyline batch ---------- */
+
+// Index buffer for 'traces' connected polylines of 'points' vertices each,
+// vertex t * points + i being point i of trace t. Traces are separated by
+// the fixed restart index, so one glDrawElements(GL_LINE_STRIP) draws all
+// of them, and every interior point is stored and shaded once instead of
+// twice as with GL_LINES. The indices only depend on the trace lengths and
+// stay in the buffer across frames.
+typedef struct {
+    GLuint index_buffer;
+    GLenum index_type;    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLsizei count;        // indices including the restart markers
+} polyline_batch_t;
+
+// Builds the indices into the GL_ELEMENT_ARRAY_BUFFER binding of the
+// current VAO.
+static void polyline_batch_init(polyline_batch_t *batch, int traces, int points)
+{
+    size_t vertices = (size_t)traces * points;
+    batch->count = (GLsizei)(vertices + traces - 1);
+    batch->index_type = vertices < 0xFFFF ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    size_t index_size = batch->index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+
+    uint8_t *indices = malloc(batch->count * index_size);
+    size_t k = 0;
+    for (int t = 0; t < traces; t++) {
+        if (t > 0) {
+            // the restart index is the largest value of the index type
+            if (index_size == 2) ((uint16_t *)indices)[k++] = 0xFFFF;
+            else                 ((uint32_t *)indices)[k++] = 0xFFFFFFFFu;
+        }
+        for (int i = 0; i < points; i++, k++) {
+            uint32_t v = (uint32_t)(t * points + i);
+            if (index_size == 2) ((uint16_t *)indices)[k] = (uint16_t)v;
+            else                 ((uint32_t *)indices)[k] = v;
+        }
+    }
+
+    glGenBuffers(1, &batch->index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, batch->count * index_size, indices, GL_STATIC_DRAW);
+    free(indices);
+
+    glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+}
+
+static void polyline_batch_draw(const polyline_batch_t *batch)
+{
+    glDrawElements(GL_LINE_STRIP, batch->count, batch->index_type, 0);
+}
+
+/* ---------- Trace renderer ---------- */
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+enum { DRAW_PER_TRACE, DRAW_BATCH };
+
+enum { LAYOUT_STACK, LAYOUT_GRID };
+
+// Per-lead entry of the Traces uniform block (std140, three vec4).
+typedef struct {
+    float xform[4];       // x offset, NDC per sample, y center, NDC per LSB
+    float clip[4];        // panel in NDC: x0 y0 x1 y1
+    float color[4];
+} trace_params_t;
+
+typedef struct {
+    GLuint program;
+    GLuint vertex_array_object;
+    GLuint uniform_buffer;
+    GLint u_head;
+    int leads;
+    int visible;
+    polyline_batch_t batch;
+} trace_renderer_t;
+
+// Lays the leads out in panels and writes gains, panels and colors to the
+// uniform buffer. Stack puts every lead in a full-width row; grid is the
+// usual 12-lead sheet with I-III, aVR-aVF, V1-V3 and V4-V6 in four columns.
+// 'gain_uv' is the amplitude in microvolts that fills half a panel.
+// Only the uniform buffer changes, the samples and indices stay as they are.
+static void trace_layout(trace_renderer_t *tr, int layout, float gain_uv)
+{
+    trace_params_t params[MAX_LEADS];
+    int columns = (layout == LAYOUT_GRID && tr->leads > 3) ? (tr->leads + 2) / 3 : 1;
+    int rows = (tr->leads + columns - 1) / columns;
+    float w = 2.0f / columns, h = 2.0f / rows;
+
+    for (int l = 0; l < tr->leads; l++) {
+        int col = l / rows, row = l % rows;
+        float x0 = -1.0f + col * w;
+        float y1 = 1.0f - row * h;
+        // a small gap between panels
+        float gap = (columns > 1) ? 0.01f : 0.0f;
+
+        trace_params_t *t = &params[l];
+        t->xform[0] = x0 + gap;
+        t->xform[1] = (w - 2.0f * gap) / (tr->visible - 1);
+        t->xform[2] = y1 - 0.5f * h;
+        t->xform[3] = 0.5f * h / gain_uv;
+        t->clip[0] = x0 + gap;
+        t->clip[1] = y1 - h;
+        t->clip[2] = x0 + w - gap;
+        t->clip[3] = y1;
+
+        // limb leads green, augmented cyan, chest leads yellow
+        static const float colors[3][4] = {
+            { 0.2f, 1.0f, 0.3f, 1.0f }, { 0.3f, 0.9f, 1.0f, 1.0f }, { 1.0f, 0.9f, 0.3f, 1.0f }
+        };
+        const float *c = colors[l < 3 ? 0 : l < 6 ? 1 : 2];
+        for (int k = 0; k < 4; k++) t->color[k] = c[k];
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, tr->uniform_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, tr->leads * sizeof(trace_params_t), params);
+}
+
+// Vertex lead * visible + i is sample head - visible + i of that lead;
+// there are no vertex attributes at all, position comes from gl_VertexID
+// and the texture. Transform, panel and color of each lead come from the
+// Traces uniform block, so all leads can be drawn in one call; fragments
+// outside a lead's panel are discarded.
+static void trace_init(trace_renderer_t *tr, const sample_ring_t *ring, int visible)
+{
+    const char *vertex_shader_source =
+        "#version 300 es\n"
+        "uniform highp isampler2D samples;"
+        "uniform int head;"           // ring index of the next sample
+        "uniform int ring_mask;"
+        "uniform int leads;"
+        "uniform int visible;"
+        "struct trace_t { vec4 xform; vec4 clip; vec4 color; };"
+        "layout(std140) uniform Traces { trace_t trace[" STR(MAX_LEADS) "]; };"
+        "out vec4 vColor;"
+        "out vec2 vPosition;"
+        "flat out vec4 vClip;"
+        "const int ring_shift = " STR(RING_SHIFT) ";"
+        "void main(){"
+        "int lead = gl_VertexID / visible;"
+        "int i = gl_VertexID - lead * visible;"
+        "int s = (head - visible + i) & ring_mask;"
+        "ivec2 texel = ivec2(s & ((1 << ring_shift) - 1), (s >> ring_shift) * leads + lead);"
+        "float v = float(texelFetch(samples, texel, 0).r);"
+        "vec4 xf = trace[lead].xform;"
+        "vPosition = vec2(xf.x + float(i) * xf.y, xf.z + v * xf.w);"
+        "vClip = trace[lead].clip;"
+        "vColor = trace[lead].color;"
+        "gl_Position = vec4(vPosition, 0.0, 1.0);"
+        "}";
+
+    const char *fragment_shader_source =
+        "#version 300 es\n"
+        "precision highp float;"
+        "in vec4 vColor;"
+        "in vec2 vPosition;"
+        "flat in vec4 vClip;"
+        "out vec4 fragColor;"
+        "void main(){"
+        "if (any(lessThan(vPosition, vClip.xy)) || any(greaterThan(vPosition, vClip.zw))) discard;"
+        "fragColor = vColor;"
+        "}";
+
+    tr->leads = ring->leads;
+    tr->visible = visible;
+
+    tr->program = create_program(vertex_shader_source, fragment_shader_source);
+    glUseProgram(tr->program);
+    tr->u_head = glGetUniformLocation(tr->program, "head");
+
+    glUniform1i(glGetUniformLocation(tr->program, "samples"), 0);
+    glUniform1i(glGetUniformLocation(tr->program, "ring_mask"), ring->size - 1);
+    glUniform1i(glGetUniformLocation(tr->program, "leads"), ring->leads);
+    glUniform1i(glGetUniformLocation(tr->program, "visible"), visible);
+
+    // the block is declared for MAX_LEADS entries, so size it for all of them
+    glGenBuffers(1, &tr->uniform_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, tr->uniform_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, MAX_LEADS * sizeof(trace_params_t), NULL, GL_DYNAMIC_DRAW);
+    glUniformBlockBinding(tr->program, glGetUniformBlockIndex(tr->program, "Traces"), 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, tr->uniform_buffer);
+
+    glGenVertexArrays(1, &tr->vertex_array_object);
+    glBindVertexArray(tr->vertex_array_object);
+    polyline_batch_init(&tr->batch, ring->leads, visible);
+}
+
+// Draws the newest 'visible' samples of every lead, either as one strip
+// per lead or all leads in a single restart-separated batch.
+// Returns the number of draw calls.
+static int trace_draw(const trace_renderer_t *tr, const sample_ring_t *ring, int mode)
+{
+    glUniform1i(tr->u_head, (int)(ring->head & (uint64_t)(ring->size - 1)));
+
+    if (mode == DRAW_BATCH) {
+        polyline_batch_draw(&tr->batch);
+        return 1;
+    }
+    for (int l = 0; l < tr->leads; l++)
+        glDrawArrays(GL_LINE_STRIP, l * tr->visible, tr->visible);
+    return tr->leads;
+}
+
+enum { STAGE_UPLOAD, STAGE_DRAW, STAGE_PRESENT, STAGE_FRAME, STAGE_GPU, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "generate and upload", "draw and swap", "present", "frame", "gpu execution",
+};
+
+int main(int argc, char **argv)
+{
+    double t_launch = get_seconds();
+    uint64_t seed = (uint64_t)time(0);
+    int leads = MAX_LEADS;
+    int rate = 500;
+    float seconds = 4.0f;
+    int draw_mode = DRAW_BATCH;
+    int layout = LAYOUT_STACK;
+    float gain_uv = 2000.0f;
+    float cycle = 0.0f;
+    backend_t backend = BACKEND_DEFAULT;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:r:t:m:L:g:c:B:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'l': leads = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 't': seconds = strtof(optarg, NULL); break;
+        case 'm':
+            if      (!strcmp(optarg, "trace")) draw_mode = DRAW_PER_TRACE;
+            else if (!strcmp(optarg, "batch")) draw_mode = DRAW_BATCH;
+            else goto usage;
+            break;
+        case 'L':
+            if      (!strcmp(optarg, "stack")) layout = LAYOUT_STACK;
+            else if (!strcmp(optarg, "grid"))  layout = LAYOUT_GRID;
+            else goto usage;
+            break;
+        case 'g': gain_uv = strtof(optarg, NULL) * 1000.0f; break;
+        case 'c': cycle = strtof(optarg, NULL); break;
+        case 'B':
+            if (!backend_parse(&backend, optarg)) goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (leads < 1 || leads > MAX_LEADS || rate < 1 || seconds * rate < 2.0f || gain_uv <= 0.0f) {
+    usage:
+        fprintf(stderr, "usage: %s [-s seed] [-l 1-%d leads] [-r samples/s] [-t seconds shown]\n"
+                        "          [-m trace|batch] [-L stack|grid] [-g mV] [-c seconds]\n"
+                        "          [-B " BACKEND_USAGE "]\n"
+                        "  -m  trace: one line strip draw call per lead\n"
+                        "      batch: all leads in one primitive-restart draw call (default)\n"
+                        "  -L  panel layout, stacked rows (default) or 12-lead grid\n"
+                        "  -g  amplitude filling half a panel, default 2 mV\n"
+                        "  -c  switch layout and double/halve the gain every n seconds\n",
+                argv[0], MAX_LEADS);
+        return 1;
+    }
+
+    GraphicsContext gfx;
+    graphics_init(&gfx, &backend, t_launch);
+
+    // GL objects do not depend on the mode; create them while the kms
+    // thread is still probing and setting it
+    double t_objects = get_seconds();
+    int visible = (int)(seconds * rate);
+
+    sample_ring_t ring;
+    sample_ring_init(&ring, leads, visible);
+
+    trace_renderer_t tr;
+    trace_init(&tr, &ring, visible);
+    trace_layout(&tr, layout, gain_uv);
+
+    ecg_source_t src = { .leads = leads, .rate = rate, .heart_rate = 72.0f / 60.0f };
+    rng_seed(&src.rng, seed);
+    printf("Seed: %" PRIu64 "\n", seed);
+    printf("ECG : %d leads, %d Hz, %d samples shown, ring %d samples\n",
+           leads, rate, visible, ring.size);
+
+    // at most one second of samples per frame, older ones are skipped
+    int16_t *staging = malloc((size_t)leads * rate * sizeof(int16_t));
+    init_phase(&gfx, "gl: objects", t_objects);
+
+    graphics_attach(&gfx);
+
+    double t_first = get_seconds();
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
+    graphics_present(&gfx);
+    init_phase(&gfx, "gl: first frame", t_first);
+    // cold start: process entry to the first (blank) GL frame on screen
+    printf("First Frame: %.6f sec (programs %.6f sec, %d cached, %d compiled)\n",
+           get_seconds() - t_launch, program_stats.seconds,
+           program_stats.loaded, program_stats.compiled);
+
+    // stage times go into histograms, see stage-timing.h
+    stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+    // GPU side of each frame and its overlap with the CPU, see gpu-timing.h
+    gpu_timer_t gpu;
+    gpu_timer_init(&gpu, st, STAGE_GPU);
+
+    src.start = get_seconds();
+    double t_report = src.start;
+    uint64_t samples = 0;
+    uint32_t frames = 0;
+    int draw_calls = 0;
+    double t_cycle = src.start;
+
+    for (;;)
+    {
+        double t0 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        if (cycle > 0.0f && t0 - t_cycle >= cycle) {
+            // relayout: a few hundred bytes of uniforms, no sample or index upload
+            layout = (layout == LAYOUT_STACK) ? LAYOUT_GRID : LAYOUT_STACK;
+            gain_uv *= (layout == LAYOUT_GRID) ? 0.5f : 2.0f;
+            trace_layout(&tr, layout, gain_uv);
+            t_cycle = t0;
+        }
+        uint64_t due = (uint64_t)((t0 - src.start) * rate);
+        if (due - src.produced > (uint64_t)rate)
+            src.produced = due - rate;
+        int n = (int)(due - src.produced);
+
+        ecg_generate(&src, staging, n);
+        // the texture upload is GPU work of the frame too
+        gpu_timer_begin(&gpu);
+        sample_ring_push(&ring, staging, n);
+        double t1 = get_seconds();
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        draw_calls = trace_draw(&tr, &ring, draw_mode);
+        gpu_timer_end(&gpu, t0);
+        eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
+        double t2 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        graphics_present(&gfx);
+        double t3 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+
+        samples += n;
+        frames++;
+        stage_record(st, STAGE_UPLOAD, 0, t0, t1);
+        stage_record(st, STAGE_DRAW, 0, t1, t2);
+        stage_record(st, STAGE_PRESENT, 0, t2, t3);
+        stage_record(st, STAGE_FRAME, 0, t0, t3);
+
+        int poll = stage_poll(st);
+        if (poll == STAGE_STOP)
+            break;
+        if (poll != STAGE_REPORT)
+            continue;
+
+        printf("Frames/sec : %.2f \n", frames / (t3 - t_report));
+        printf("Samples    : %.1f per frame and lead, %.0f bytes uploaded per frame \n",
+               (double)samples / frames, (double)samples * leads * sizeof(int16_t) / frames);
+        printf("Draw       : %d draw calls, %d vertices \n", draw_calls, leads * visible);
+        gpu_timer_report(&gpu);
+        printf("\n");
+
+        t_report = t3;
+        samples = 0;
+        frames = 0;
+    }
+
+    stage_finish(st);
+    return 0;
+}
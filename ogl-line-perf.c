@@ -1,29 +1,82 @@
 // Build:
-// gcc ogl-min-line-perf-pageflip.c -o ogl-min-line-perf-pageflip \
+// gcc ogl-line-perf.c -O2 -o ogl-line-perf \
 //         $(pkg-config --cflags --libs egl glesv2 gbm libdrm)
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <getopt.h>
 #include <sys/select.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <gbm.h>
 #include <EGL/egl.h>
-#include <GLES3/gl3.h>
+#include <GLES3/gl31.h>
+
+#include "fast-rand.h"
+#include "vertex-ring.h"
+#include "gl-program.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "stage-timing.h"
+#include "gpu-timing.h"
+
+// 8-byte vertex: position in pixels, RGBA8 color with R in the low byte
+typedef struct {
+    int16_t x, y;
+    uint32_t rgba;
+} line_vertex_t;
+
+// Compute rasterizer (-r compute, needs GLES 3.1): the screen is split into
+// TILE_SIZE x TILE_SIZE tiles and drawn in four dispatches, like the CPU
+// binning in kms-min-mt.c.
+//   count:  one invocation per line adds 1 to every tile the line touches
+//   scan:   prefix sum of the counts gives each tile's range in the bin array
+//   bin:    the lines write their index into those ranges
+//   raster: one workgroup per tile draws the tile's lines into shared memory
+//           and stores the finished tile into an RGBA8 image
+// The image is then blitted to the gbm_surface. Per pixel the highest line
+// index wins (atomicMax), so the result matches GL_LINES draw order even
+// though the lines of a tile are drawn in parallel. A tile of winners is
+// TILE_SIZE^2 * 4 bytes of shared memory; 32 keeps it at 4 KiB.
+#define TILE_SIZE 32
+#define BIN_LOCAL_SIZE 64
+#define RASTER_LOCAL_SIZE 256
+
+typedef struct {
+    GLuint count_program;
+    GLuint scan_program;
+    GLuint bin_program;
+    GLuint raster_program;
+
+    GLuint tile_count;          // SSBO: lines per tile, zero between frames
+    GLuint tile_start;          // SSBO: tiles + 1 prefix sums, last one is the total
+    GLuint bins;                // SSBO: line indices, grouped by tile
+    GLuint image;
+    GLuint framebuffer;         // read framebuffer for the blit
+
+    int tiles_x, tiles_y;
+    uint32_t bin_capacity;      // entries in bins
+    uint32_t bin_limit;         // GL_MAX_SHADER_STORAGE_BLOCK_SIZE in entries
+    uint32_t bin_total;         // entries the last frame needed
+    uint32_t overflows;         // frames that lost lines because bins was full
+} compute_raster_t;
 
 typedef struct {
     int drm_fd;
+    int headless;       // -B headless: pbuffer, no KMS
     int screen_width;
     int screen_height;
 
     drmModeModeInfo mode;
     drmModeConnector *connector;
-    drmModeEncoder   *encoder;
 
     struct gbm_device  *gbm_device;
     struct gbm_surface *gbm_surface;
@@ -57,23 +110,6 @@ static inline double get_seconds()
    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static GLuint create_shader(GLenum type, const char *source)
-{
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, 0);
-    glCompileShader(shader);
-    return shader;
-}
-
-static GLuint create_program(const char *vs, const char *fs)
-{
-    GLuint program = glCreateProgram();
-    glAttachShader(program, create_shader(GL_VERTEX_SHADER, vs));
-    glAttachShader(program, create_shader(GL_FRAGMENT_SHADER, fs));
-    glLinkProgram(program);
-    return program;
-}
-
 static void page_flip_handler(int fd, unsigned int frame,
                               unsigned int sec, unsigned int usec,
                               void *data)
@@ -110,27 +146,24 @@ static uint32_t add_fb(GraphicsContext *gfx, struct gbm_bo *bo)
     return fb;
 }
 
-static GraphicsContext graphics_init(void)
+// KMS display, GBM surface and EGL window surface on it
+static void display_init(GraphicsContext *gfx, const backend_t *backend, int es_minor)
 {
-    GraphicsContext gfx = (GraphicsContext){0};
+    gfx->drm_fd = backend_open(backend);
 
-    gfx.drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+    drmModeRes *resources = drmModeGetResources(gfx->drm_fd);
+    gfx->connector = backend_output(gfx->drm_fd, resources, &gfx->crtc_id);
+    gfx->mode = gfx->connector->modes[0];
 
-    drmModeRes *resources = drmModeGetResources(gfx.drm_fd);
-    gfx.connector = drmModeGetConnector(gfx.drm_fd, resources->connectors[0]);
-    gfx.mode = gfx.connector->modes[0];
-    gfx.encoder = drmModeGetEncoder(gfx.drm_fd, gfx.connector->encoder_id);
+    gfx->screen_width  = gfx->mode.hdisplay;
+    gfx->screen_height = gfx->mode.vdisplay;
 
-    gfx.screen_width  = gfx.mode.hdisplay;
-    gfx.screen_height = gfx.mode.vdisplay;
+    gfx->connector_id = gfx->connector->connector_id;
 
-    gfx.crtc_id = gfx.encoder->crtc_id;
-    gfx.connector_id = gfx.connector->connector_id;
+    gfx->gbm_device = gbm_create_device(gfx->drm_fd);
 
-    gfx.gbm_device = gbm_create_device(gfx.drm_fd);
-
-    gfx.egl_display = eglGetDisplay((EGLNativeDisplayType)gfx.gbm_device);
-    eglInitialize(gfx.egl_display, 0, 0);
+    gfx->egl_display = eglGetDisplay((EGLNativeDisplayType)gfx->gbm_device);
+    eglInitialize(gfx->egl_display, 0, 0);
     eglBindAPI(EGL_OPENGL_ES_API);
 
     EGLint config_attributes[] = {
@@ -144,43 +177,65 @@ static GraphicsContext graphics_init(void)
     };
 
     EGLint num_configs;
-    eglChooseConfig(gfx.egl_display, config_attributes, &gfx.egl_config, 1, &num_configs);
+    eglChooseConfig(gfx->egl_display, config_attributes, &gfx->egl_config, 1, &num_configs);
 
     EGLint format;
-    eglGetConfigAttrib(gfx.egl_display, gfx.egl_config, EGL_NATIVE_VISUAL_ID, &format);
+    eglGetConfigAttrib(gfx->egl_display, gfx->egl_config, EGL_NATIVE_VISUAL_ID, &format);
 
-    gfx.gbm_surface = gbm_surface_create(
-        gfx.gbm_device,
-        gfx.screen_width,
-        gfx.screen_height,
+    gfx->gbm_surface = gbm_surface_create(
+        gfx->gbm_device,
+        gfx->screen_width,
+        gfx->screen_height,
         format,
         GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
     );
 
-    gfx.egl_context = eglCreateContext(
-        gfx.egl_display,
-        gfx.egl_config,
+    gfx->egl_context = eglCreateContext(
+        gfx->egl_display,
+        gfx->egl_config,
         EGL_NO_CONTEXT,
-        (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
+        (EGLint[]){ EGL_CONTEXT_MAJOR_VERSION, 3,
+                    EGL_CONTEXT_MINOR_VERSION, es_minor, EGL_NONE }
     );
+    if (gfx->egl_context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "no OpenGL ES 3.%d context\n", es_minor);
+        exit(1);
+    }
 
-    gfx.egl_surface = eglCreateWindowSurface(
-        gfx.egl_display,
-        gfx.egl_config,
-        (EGLNativeWindowType)gfx.gbm_surface,
+    gfx->egl_surface = eglCreateWindowSurface(
+        gfx->egl_display,
+        gfx->egl_config,
+        (EGLNativeWindowType)gfx->gbm_surface,
         0
     );
 
-    eglMakeCurrent(gfx.egl_display, gfx.egl_surface, gfx.egl_surface, gfx.egl_context);
+    eglMakeCurrent(gfx->egl_display, gfx->egl_surface, gfx->egl_surface, gfx->egl_context);
+}
+
+// es_minor 1 asks for a GLES 3.1 context, needed by the compute rasterizer
+static GraphicsContext graphics_init(const backend_t *backend, int es_minor)
+{
+    GraphicsContext gfx = (GraphicsContext){0};
+
+    if (backend->kind == BACKEND_HEADLESS) {
+        gfx.headless = 1;
+        gfx.screen_width  = backend->width;
+        gfx.screen_height = backend->height;
+        backend_egl_headless(backend, es_minor, &gfx.egl_display, &gfx.egl_config,
+                             &gfx.egl_context, &gfx.egl_surface);
+    } else {
+        display_init(&gfx, backend, es_minor);
+    }
 
     const char *vertex_shader_source =
         "#version 300 es\n"
         "layout(location=0) in vec2 position;"
         "layout(location=1) in vec4 color;"
+        "uniform vec4 pixel_to_ndc;"
         "out vec4 vColor;"
         "void main(){"
         "vColor = color;"
-        "gl_Position = vec4(position,0.0,1.0);"
+        "gl_Position = vec4(position*pixel_to_ndc.xy + pixel_to_ndc.zw,0.0,1.0);"
         "}";
 
     const char *fragment_shader_source =
@@ -195,16 +250,22 @@ static GraphicsContext graphics_init(void)
     gfx.shader_program = create_program(vertex_shader_source, fragment_shader_source);
     glUseProgram(gfx.shader_program);
 
+    // pixel (0,0) is the top left corner
+    glUniform4f(glGetUniformLocation(gfx.shader_program, "pixel_to_ndc"),
+                2.0f / (gfx.screen_width - 1), -2.0f / (gfx.screen_height - 1), -1.0f, 1.0f);
+
     glGenVertexArrays(1, &gfx.vertex_array_object);
     glBindVertexArray(gfx.vertex_array_object);
 
     glGenBuffers(1, &gfx.vertex_buffer_object);
     glBindBuffer(GL_ARRAY_BUFFER, gfx.vertex_buffer_object);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, x));
     glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, rgba));
     glEnableVertexAttribArray(1);
 
     glViewport(0, 0, gfx.screen_width, gfx.screen_height);
@@ -213,8 +274,278 @@ static GraphicsContext graphics_init(void)
     return gfx;
 }
 
+/* ---------- Compute rasterizer ---------- */
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+// Declarations shared by the four compute shaders, plus the Bresenham
+// setup of kms-min-mt.c. Lines are read straight from the vertex ring
+// region as uvec4 (x0|y0<<16, rgba, x1|y1<<16, rgba). grid is (width,
+// height, tiles_x, tiles_y). The products in line_minor() fit 32 bits
+// for on-screen endpoints.
+#define RASTER_COMMON \
+    "#version 310 es\n" \
+    "const int tile_size = " STR(TILE_SIZE) ";" \
+    "layout(std430, binding=0) readonly buffer Lines { uvec4 line[]; };" \
+    "layout(std430, binding=1) buffer TileCount { uint tile_count[]; };" \
+    "layout(std430, binding=2) buffer TileStart { uint tile_start[]; };" \
+    "layout(std430, binding=3) buffer Bins { uint bin[]; };" \
+    "uniform ivec4 grid;" \
+    "uniform uint line_count;" \
+    "uniform uint bin_capacity;" \
+    "struct setup_t { bool x_major; int maj0, min0, dmaj, dmin, smaj, smin, den; };" \
+    "setup_t line_setup(uint l){" \
+    "uvec4 v = line[l];" \
+    "int x0 = int(v.x << 16) >> 16, y0 = int(v.x) >> 16;" \
+    "int x1 = int(v.z << 16) >> 16, y1 = int(v.z) >> 16;" \
+    "int dx = abs(x1 - x0), dy = abs(y1 - y0);" \
+    "int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;" \
+    "setup_t ls;" \
+    "ls.x_major = dx >= dy;" \
+    "ls.maj0 = ls.x_major ? x0 : y0; ls.min0 = ls.x_major ? y0 : x0;" \
+    "ls.dmaj = ls.x_major ? dx : dy; ls.dmin = ls.x_major ? dy : dx;" \
+    "ls.smaj = ls.x_major ? sx : sy; ls.smin = ls.x_major ? sy : sx;" \
+    "ls.den = ls.dmaj != 0 ? 2 * ls.dmaj : 1;" \
+    "return ls;" \
+    "}" \
+    "int line_step(setup_t ls, int m){ return ls.smaj > 0 ? m - ls.maj0 : ls.maj0 - m; }" \
+    "int line_minor(setup_t ls, int i){ return ls.min0 + ls.smin * ((2 * i * ls.dmin + ls.dmaj) / ls.den); }"
+
+// Visits every tile line l has a pixel in (line_tiles() of kms-min-mt.c)
+// and bumps its count; the bin pass also stores l at the slot it got.
+#define RASTER_VISIT_TILES(store) \
+    "void visit_tiles(uint l){" \
+    "setup_t ls = line_setup(l);" \
+    "int maj_size = ls.x_major ? grid.x : grid.y;" \
+    "int min_size = ls.x_major ? grid.y : grid.x;" \
+    "int maj_end = ls.maj0 + ls.smaj * ls.dmaj;" \
+    "int lo = max(min(ls.maj0, maj_end), 0);" \
+    "int hi = min(max(ls.maj0, maj_end), maj_size - 1);" \
+    "for (int t = lo / tile_size; lo <= hi && t <= hi / tile_size; t++) {" \
+    "int ma = line_minor(ls, line_step(ls, max(t * tile_size, lo)));" \
+    "int mb = line_minor(ls, line_step(ls, min(t * tile_size + tile_size - 1, hi)));" \
+    "int mlo = max(min(ma, mb), 0);" \
+    "int mhi = min(max(ma, mb), min_size - 1);" \
+    "for (int u = mlo / tile_size; mlo <= mhi && u <= mhi / tile_size; u++) {" \
+    "uint tile = uint(ls.x_major ? u * grid.z + t : t * grid.z + u);" \
+    "uint slot = atomicAdd(tile_count[tile], 1u);" \
+    store \
+    "}" \
+    "}" \
+    "}" \
+    "layout(local_size_x = " STR(BIN_LOCAL_SIZE) ") in;" \
+    "void main(){ if (gl_GlobalInvocationID.x < line_count) visit_tiles(gl_GlobalInvocationID.x); }"
+
+static void compute_raster_uniforms(const compute_raster_t *cr, GLuint program,
+                                    int width, int height, int line_count)
+{
+    glUseProgram(program);
+    glUniform4i(glGetUniformLocation(program, "grid"), width, height, cr->tiles_x, cr->tiles_y);
+    glUniform1ui(glGetUniformLocation(program, "line_count"), (GLuint)line_count);
+    glUniform1ui(glGetUniformLocation(program, "bin_capacity"), cr->bin_capacity);
+}
+
+static void compute_raster_init(compute_raster_t *cr, const GraphicsContext *gfx, int line_count)
+{
+    const char *count_shader_source =
+        RASTER_COMMON
+        RASTER_VISIT_TILES("");
+
+    const char *bin_shader_source =
+        RASTER_COMMON
+        RASTER_VISIT_TILES("uint at = tile_start[tile] + slot; if (at < bin_capacity) bin[at] = l;");
+
+    // a single invocation; a few thousand tiles are not worth a parallel scan.
+    // Resetting the counts here lets the bin pass reuse them as cursors.
+    const char *scan_shader_source =
+        RASTER_COMMON
+        "layout(local_size_x = 1) in;"
+        "void main(){"
+        "uint tiles = uint(grid.z * grid.w);"
+        "uint sum = 0u;"
+        "for (uint t = 0u; t < tiles; t++) {"
+        "tile_start[t] = sum;"
+        "sum += tile_count[t];"
+        "tile_count[t] = 0u;"
+        "}"
+        "tile_start[tiles] = sum;"
+        "}";
+
+    // Each invocation draws every RASTER_LOCAL_SIZE-th line of the tile,
+    // clipped to the tile, and keeps the highest line index per pixel.
+    const char *raster_shader_source =
+        RASTER_COMMON
+        "layout(local_size_x = " STR(RASTER_LOCAL_SIZE) ") in;"
+        "layout(rgba8, binding=0) writeonly uniform highp image2D target;"
+        "shared uint winner[tile_size * tile_size];"
+        "void main(){"
+        "uint tile = gl_WorkGroupID.y * uint(grid.z) + gl_WorkGroupID.x;"
+        "ivec2 origin = ivec2(gl_WorkGroupID.xy) * tile_size;"
+        "ivec2 last = min(origin + tile_size - 1, grid.xy - 1);"
+        "for (uint p = gl_LocalInvocationIndex; p < uint(tile_size * tile_size); p += gl_WorkGroupSize.x)"
+        "winner[p] = 0u;"
+        "memoryBarrierShared(); barrier();"
+        "uint end = min(tile_start[tile + 1u], bin_capacity);"
+        "for (uint k = tile_start[tile] + gl_LocalInvocationIndex; k < end; k += gl_WorkGroupSize.x) {"
+        "uint l = bin[k];"
+        "setup_t ls = line_setup(l);"
+        "int maj_lo = ls.x_major ? origin.x : origin.y, maj_hi = ls.x_major ? last.x : last.y;"
+        "int min_lo = ls.x_major ? origin.y : origin.x, min_hi = ls.x_major ? last.y : last.x;"
+        "int i0 = max(line_step(ls, ls.smaj > 0 ? maj_lo : maj_hi), 0);"
+        "int i1 = min(line_step(ls, ls.smaj > 0 ? maj_hi : maj_lo), ls.dmaj);"
+        "int num = 2 * i0 * ls.dmin + ls.dmaj;"
+        "int maj = ls.maj0 + ls.smaj * i0;"
+        "int mnr = ls.min0 + ls.smin * (num / ls.den);"
+        "int err = num % ls.den;"
+        "for (int i = i0; i <= i1; i++) {"
+        "if (mnr >= min_lo && mnr <= min_hi) {"
+        "ivec2 p = (ls.x_major ? ivec2(maj, mnr) : ivec2(mnr, maj)) - origin;"
+        "atomicMax(winner[p.y * tile_size + p.x], l + 1u);"
+        "}"
+        "maj += ls.smaj;"
+        "err += 2 * ls.dmin;"
+        "if (err >= ls.den) { err -= ls.den; mnr += ls.smin; }"
+        "}"
+        "}"
+        "memoryBarrierShared(); barrier();"
+        "for (uint p = gl_LocalInvocationIndex; p < uint(tile_size * tile_size); p += gl_WorkGroupSize.x) {"
+        "ivec2 xy = origin + ivec2(int(p) % tile_size, int(p) / tile_size);"
+        "if (any(greaterThan(xy, last))) continue;"
+        "uint w = winner[p];"
+        "imageStore(target, xy, w != 0u ? unpackUnorm4x8(line[w - 1u].y) : vec4(0.0));"
+        "}"
+        "if (gl_LocalInvocationIndex == 0u) tile_count[tile] = 0u;"
+        "}";
+
+    *cr = (compute_raster_t){0};
+    cr->count_program  = create_compute_program(count_shader_source);
+    cr->scan_program   = create_compute_program(scan_shader_source);
+    cr->bin_program    = create_compute_program(bin_shader_source);
+    cr->raster_program = create_compute_program(raster_shader_source);
+
+    cr->tiles_x = (gfx->screen_width  + TILE_SIZE - 1) / TILE_SIZE;
+    cr->tiles_y = (gfx->screen_height + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles = cr->tiles_x * cr->tiles_y;
+
+    GLint block_size;
+    glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &block_size);
+    cr->bin_limit = (uint32_t)block_size / sizeof(uint32_t);
+
+    // first guess, grown after a frame that needed more
+    uint64_t capacity = (uint64_t)line_count * 16;
+    cr->bin_capacity = capacity < cr->bin_limit ? (uint32_t)capacity : cr->bin_limit;
+
+    GLuint *zero = calloc(tiles + 1, sizeof(GLuint));
+    glGenBuffers(1, &cr->tile_count);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cr->tile_count);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, tiles * sizeof(GLuint), zero, GL_DYNAMIC_COPY);
+    glGenBuffers(1, &cr->tile_start);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cr->tile_start);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (tiles + 1) * sizeof(GLuint), zero, GL_DYNAMIC_COPY);
+    free(zero);
+    glGenBuffers(1, &cr->bins);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cr->bins);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)cr->bin_capacity * sizeof(GLuint),
+                 NULL, GL_DYNAMIC_COPY);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, cr->tile_count);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cr->tile_start);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, cr->bins);
+
+    glGenTextures(1, &cr->image);
+    glBindTexture(GL_TEXTURE_2D, cr->image);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, gfx->screen_width, gfx->screen_height);
+    glBindImageTexture(0, cr->image, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+
+    glGenFramebuffers(1, &cr->framebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, cr->framebuffer);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, cr->image, 0);
+
+    compute_raster_uniforms(cr, cr->count_program,  gfx->screen_width, gfx->screen_height, line_count);
+    compute_raster_uniforms(cr, cr->scan_program,   gfx->screen_width, gfx->screen_height, line_count);
+    compute_raster_uniforms(cr, cr->bin_program,    gfx->screen_width, gfx->screen_height, line_count);
+    compute_raster_uniforms(cr, cr->raster_program, gfx->screen_width, gfx->screen_height, line_count);
+    glUseProgram(gfx->shader_program);
+}
+
+// Draws line_count lines from the vertex ring region at 'offset' of 'buffer'
+// into the default framebuffer. Replaces glClear() + glDrawArrays().
+static void compute_raster_draw(const compute_raster_t *cr, const GraphicsContext *gfx,
+                                GLuint buffer, GLintptr offset, int line_count)
+{
+    GLuint line_groups = (GLuint)(line_count + BIN_LOCAL_SIZE - 1) / BIN_LOCAL_SIZE;
+
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, buffer, offset,
+                      (GLsizeiptr)line_count * 2 * sizeof(line_vertex_t));
+
+    glUseProgram(cr->count_program);
+    glDispatchCompute(line_groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(cr->scan_program);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(cr->bin_program);
+    glDispatchCompute(line_groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(cr->raster_program);
+    glDispatchCompute(cr->tiles_x, cr->tiles_y, 1);
+    // the blit reads the image; the next frame's count pass atomically adds
+    // to the tile_count entries this pass reset with plain stores
+    glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // image row 0 is the top of the screen, so flip while blitting
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, gfx->screen_width, gfx->screen_height,
+                      0, gfx->screen_height, gfx->screen_width, 0,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glUseProgram(gfx->shader_program);
+}
+
+// Reads the bin total of the last frame; call once it has been presented,
+// mapping waits for the GPU otherwise. Grows the bin array if lines were lost.
+static void compute_raster_check(compute_raster_t *cr)
+{
+    int tiles = cr->tiles_x * cr->tiles_y;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cr->tile_start);
+    const GLuint *total = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, tiles * sizeof(GLuint),
+                                           sizeof(GLuint), GL_MAP_READ_BIT);
+    cr->bin_total = *total;
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+    if (cr->bin_total <= cr->bin_capacity)
+        return;
+
+    cr->overflows++;
+    if (cr->bin_capacity == cr->bin_limit)
+        return;
+
+    uint64_t capacity = (uint64_t)cr->bin_total + cr->bin_total / 4;
+    cr->bin_capacity = capacity < cr->bin_limit ? (uint32_t)capacity : cr->bin_limit;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cr->bins);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)cr->bin_capacity * sizeof(GLuint),
+                 NULL, GL_DYNAMIC_COPY);
+
+    GLuint programs[] = { cr->bin_program, cr->raster_program };
+    for (int i = 0; i < 2; i++) {
+        glUseProgram(programs[i]);
+        glUniform1ui(glGetUniformLocation(programs[i], "bin_capacity"), cr->bin_capacity);
+    }
+}
+
 static void graphics_present(GraphicsContext *gfx)
 {
+    if (gfx->headless) {
+        // nothing to flip; wait for the GPU as a flip would
+        glFinish();
+        return;
+    }
     // lock next scanout buffer (after eglSwapBuffers)
     gfx->next_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
     gfx->next_framebuffer = add_fb(gfx, gfx->next_bo);
@@ -242,77 +573,178 @@ static void graphics_present(GraphicsContext *gfx)
     gfx->next_framebuffer = 0;
 }
 
-int main(void)
-{
-    GraphicsContext gfx = graphics_init();
+enum { RENDER_GL, RENDER_COMPUTE };
+
+enum { STAGE_GENERATE, STAGE_DRAW, STAGE_PRESENT, STAGE_FRAME, STAGE_GPU, STAGE_COUNT };
 
+static const char *const stage_names[STAGE_COUNT] = {
+    "generate vertices", "draw and swap", "present", "frame", "gpu execution",
+};
+
+int main(int argc, char **argv)
+{
+    double t_launch = get_seconds();
+    uint64_t seed = (uint64_t)time(0);
     int line_count = 100000;
+    int render = RENDER_GL;
+    backend_t backend = BACKEND_DEFAULT;
+    bench_t bench = { .program = argv[0] };
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:r:B:b:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'n': line_count = atoi(optarg); break;
+        case 'r':
+            if      (!strcmp(optarg, "gl"))      render = RENDER_GL;
+            else if (!strcmp(optarg, "compute")) render = RENDER_COMPUTE;
+            else goto usage;
+            break;
+        case 'B':
+            if (!backend_parse(&backend, optarg)) goto usage;
+            break;
+        case 'b':
+            if (!bench_parse(&bench, optarg)) goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    // a scenario sets the line count and the seed
+    const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+    if (bench.scenario) {
+        line_count = scenario->lines;
+        seed = bench.seed;
+    }
+    // count and bin passes run one invocation per line in a 1D dispatch
+    if (line_count < 1 || line_count > 65535 * BIN_LOCAL_SIZE) {
+    usage:
+        fprintf(stderr, "usage: %s [-s seed] [-n 1-%d lines] [-r gl|compute]\n"
+                        "          [-B " BACKEND_USAGE "]\n"
+                        "          [-b " BENCH_USAGE "]\n"
+                        "  -r  gl: glDrawArrays(GL_LINES) (default)\n"
+                        "      compute: tiled compute shader rasterizer, GLES 3.1\n",
+                argv[0], 65535 * BIN_LOCAL_SIZE);
+        return 1;
+    }
+
+    snprintf(bench.renderer, sizeof(bench.renderer), "%s",
+             render == RENDER_COMPUTE ? "compute" : "gl lines");
+    if (render == RENDER_COMPUTE)
+        bench_require(&bench, 1.0f, 0);     // 1-pixel Bresenham only
+
+    GraphicsContext gfx = graphics_init(&backend, render == RENDER_COMPUTE ? 1 : 0);
+    if (render == RENDER_GL && bench.scenario)
+        bench_gl_line_width(&bench);
+
     int vertices_per_line = 2;
     int total_vertices = line_count * vertices_per_line;
-    int floats_per_vertex = 6;
 
-    size_t vertex_buffer_size = (size_t)total_vertices * (size_t)floats_per_vertex * sizeof(float);
-    float *vertex_data = malloc(vertex_buffer_size);
+    size_t vertex_stride = sizeof(line_vertex_t);
+    size_t vertex_buffer_size = (size_t)total_vertices * vertex_stride;
 
-    glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, 0, GL_STREAM_DRAW);
+    vertex_ring_t ring;
+    vertex_ring_init(&ring, vertex_buffer_size);
 
-    srandom(time(0));
+    compute_raster_t raster;
+    if (render == RENDER_COMPUTE)
+        compute_raster_init(&raster, &gfx, line_count);
+
+    rng_t rng;
+    rng_seed(&rng, seed);
+    printf("Seed: %" PRIu64 "\n", seed);
+    printf("Lines: %d (%s)\n", line_count, render == RENDER_COMPUTE ? "compute" : "gl");
+
+    // random words for the next RNG_BATCH lines: x0 y0 x1 y1 rgb
+    uint32_t rnd[5 * RNG_BATCH];
 
     glClear(GL_COLOR_BUFFER_BIT);
     eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
     graphics_present(&gfx);
+    // cold start: process entry to the first (blank) frame on screen
+    printf("First Frame: %.6f sec (programs %.6f sec, %d cached, %d compiled)\n",
+           get_seconds() - t_launch, program_stats.seconds,
+           program_stats.loaded, program_stats.compiled);
+
+    // stage times go into histograms, see stage-timing.h
+    stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+    // GPU side of each frame and its overlap with the CPU, see gpu-timing.h
+    gpu_timer_t gpu;
+    gpu_timer_init(&gpu, st, STAGE_GPU);
 
     for (;;)
     {
         double t0 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        int64_t pixels = 0;
+        line_vertex_t *vertex_data = vertex_ring_begin(&ring);
         for (int i = 0; i < line_count; i++)
         {
-            int x0 = random() % gfx.screen_width;
-            int y0 = random() % gfx.screen_height;
-            int x1 = random() % gfx.screen_width;
-            int y1 = random() % gfx.screen_height;
-
-            float fx0 = 2.0f * x0 / (gfx.screen_width - 1) - 1.0f;
-            float fy0 = 1.0f - 2.0f * y0 / (gfx.screen_height - 1);
-
-            float fx1 = 2.0f * x1 / (gfx.screen_width - 1) - 1.0f;
-            float fy1 = 1.0f - 2.0f * y1 / (gfx.screen_height - 1);
-
-            float r = (random() % 256) / 255.0f;
-            float g = (random() % 256) / 255.0f;
-            float b = (random() % 256) / 255.0f;
-
-            int base = i * vertices_per_line * floats_per_vertex;
-
-            vertex_data[base + 0]  = fx0;
-            vertex_data[base + 1]  = fy0;
-            vertex_data[base + 2]  = r;
-            vertex_data[base + 3]  = g;
-            vertex_data[base + 4]  = b;
-            vertex_data[base + 5]  = 1.0f;
-
-            vertex_data[base + 6]  = fx1;
-            vertex_data[base + 7]  = fy1;
-            vertex_data[base + 8]  = r;
-            vertex_data[base + 9]  = g;
-            vertex_data[base + 10] = b;
-            vertex_data[base + 11] = 1.0f;
+            if (i % RNG_BATCH == 0)
+                rng_fill(&rng, rnd, 5 * RNG_BATCH);
+            const uint32_t *q = &rnd[5 * (i % RNG_BATCH)];
+
+            // x0 y0 x1 y1
+            int p[4];
+            pixels += bench_line(scenario, q, gfx.screen_width, gfx.screen_height, p);
+
+            // alpha forced to 255
+            uint32_t rgba = q[4] | 0xFF000000u;
+
+            line_vertex_t *v = &vertex_data[i * vertices_per_line];
+            v[0] = (line_vertex_t){ (int16_t)p[0], (int16_t)p[1], rgba };
+            v[1] = (line_vertex_t){ (int16_t)p[2], (int16_t)p[3], rgba };
         }
+        vertex_ring_end(&ring);
         double t1 = get_seconds();
-
-        glClear(GL_COLOR_BUFFER_BIT);
-        glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, NULL, GL_STREAM_DRAW); // orphan
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertex_data);
-        glDrawArrays(GL_LINES, 0, total_vertices);
+        gpu_timer_poll(&gpu, 0);
+
+        gpu_timer_begin(&gpu);
+        if (render == RENDER_COMPUTE) {
+            compute_raster_draw(&raster, &gfx, gfx.vertex_buffer_object,
+                                vertex_ring_offset(&ring), line_count);
+        } else {
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_LINES, vertex_ring_first(&ring, vertex_stride), total_vertices);
+        }
+        vertex_ring_fence(&ring);
+        gpu_timer_end(&gpu, t0);
 
         eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
         double t2 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
         graphics_present(&gfx);
         double t3= get_seconds();
-        printf("Create Vert: %.6f sec \n", (t1 - t0));
-        printf("Draw Lines : %.6f sec \n", (t2 - t1));
-        printf("Flip Time  : %.6f sec \n", (t3 - t2));
-        printf("Total Time : %.6f sec \n \n", (t3 - t0));
-        sleep(1);
+        gpu_timer_poll(&gpu, 0);
+        if (render == RENDER_COMPUTE)
+            compute_raster_check(&raster);
+        stage_record(st, STAGE_GENERATE, 0, t0, t1);
+        stage_record(st, STAGE_DRAW, 0, t1, t2);
+        stage_record(st, STAGE_PRESENT, 0, t2, t3);
+        stage_record(st, STAGE_FRAME, 0, t0, t3);
+
+        if (bench.scenario) {
+            if (!bench_frame(&bench, t3 - t0, (double)pixels)) {
+                bench_report(&bench, gfx.screen_width, gfx.screen_height);
+                return 0;
+            }
+            continue;
+        }
+
+        int poll = stage_poll(st);
+        if (poll == STAGE_STOP)
+            break;
+        if (poll == STAGE_REPORT) {
+            printf("Ring Stalls: %" PRIu32 " (%.6f sec) \n", ring.stalls, ring.wait_time);
+            if (render == RENDER_COMPUTE)
+                printf("Bin Entries: %" PRIu32 " of %" PRIu32 " (%" PRIu32 " overflows) \n",
+                       raster.bin_total, raster.bin_capacity, raster.overflows);
+            gpu_timer_report(&gpu);
+            printf("\n");
+            ring.stalls = 0;
+            ring.wait_time = 0.0;
+        }
     }
+
+    stage_finish(st);
+    return 0;
 }
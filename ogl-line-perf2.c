@@ -1,6 +1,6 @@
 // Build:
 // gcc ogl-min-line-perf-pageflip.c -o ogl-min-line-perf-pageflip \
-//         $(pkg-config --cflags --libs egl glesv2 gbm libdrm)
+//         $(pkg-config --cflags --libs egl glesv2 gbm libdrm) -pthread -lm
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -8,6 +8,13 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/select.h>
 
 #include <xf86drm.h>
@@ -17,24 +24,59 @@
 #include <EGL/egl.h>
 #include <GLES3/gl3.h>
 
+#include "fast-rand.h"
+#include "vertex-ring.h"
+#include "gl-program.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "stage-timing.h"
+
+// 8-byte vertex: position in pixels, RGBA8 color with R in the low byte
+typedef struct {
+    int16_t x, y;
+    uint32_t rgba;
+} line_vertex_t;
+
 typedef struct {
     int drm_fd;
+    int headless;       // -B headless: pbuffer, no KMS
     int screen_width;
     int screen_height;
 
     drmModeModeInfo mode;
     drmModeConnector *connector;
-    drmModeEncoder   *encoder;
 
     struct gbm_device  *gbm_device;
     struct gbm_surface *gbm_surface;
     struct gbm_bo *previous_bo;
+    double t_lock[2];             // last graphics_present(): front buffer lock
+    double t_flip[2];             // and modeset / flip until it completed
 
     uint32_t crtc_id;
     uint32_t connector_id;
     int did_modeset;
 
     volatile int flip_done;
+    unsigned int flip_sequence;   // vblank counter of the last completed flip
+    double flip_time;             // its timestamp, CLOCK_MONOTONIC seconds
+
+    // Atomic KMS. Property IDs are looked up once in atomic_init();
+    // use_atomic stays 0 (legacy SetCrtc/PageFlip) if anything is missing.
+    int use_atomic;
+    uint32_t plane_id;
+    uint32_t mode_blob_id;
+    struct {
+        uint32_t fb_id, crtc_id;
+        uint32_t src_x, src_y, src_w, src_h;
+        uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+        uint32_t in_fence_fd;
+    } plane_prop;
+    struct {
+        uint32_t mode_id, active, out_fence_ptr;
+    } crtc_prop;
+    struct {
+        uint32_t crtc_id;
+    } connector_prop;
 
     EGLDisplay egl_display;
     EGLConfig  egl_config;
@@ -54,31 +96,17 @@ static inline double get_seconds()
    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static GLuint create_shader(GLenum type, const char *source)
-{
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, 0);
-    glCompileShader(shader);
-    return shader;
-}
-
-static GLuint create_program(const char *vs, const char *fs)
-{
-    GLuint program = glCreateProgram();
-    glAttachShader(program, create_shader(GL_VERTEX_SHADER, vs));
-    glAttachShader(program, create_shader(GL_FRAGMENT_SHADER, fs));
-    glLinkProgram(program);
-    return program;
-}
-
 /* ---------- Pageflip event ---------- */
 
 static void page_flip_handler(int fd, unsigned int frame,
                               unsigned int sec, unsigned int usec,
                               void *data)
 {
-    (void)fd; (void)frame; (void)sec; (void)usec;
-    ((GraphicsContext*)data)->flip_done = 1;
+    (void)fd;
+    GraphicsContext *gfx = (GraphicsContext*)data;
+    gfx->flip_sequence = frame;
+    gfx->flip_time = sec + usec * 1e-6;
+    gfx->flip_done = 1;
 }
 
 static void wait_for_flip(GraphicsContext *gfx)
@@ -138,27 +166,164 @@ static uint32_t get_or_create_fb(GraphicsContext *gfx, struct gbm_bo *bo)
     return d->fb_id;
 }
 
-static GraphicsContext graphics_init(void)
+/* ---------- Atomic modesetting ---------- */
+
+static uint32_t find_property(int fd, uint32_t obj, uint32_t type, const char *name)
 {
-    GraphicsContext gfx = {0};
+    uint32_t id = 0;
+    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj, type);
+    for (uint32_t i = 0; props && i < props->count_props && !id; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop && !strcmp(prop->name, name)) id = prop->prop_id;
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+static uint32_t find_primary_plane(int fd, drmModeRes *resources, uint32_t crtc_id)
+{
+    int crtc_index = -1;
+    for (int i = 0; i < resources->count_crtcs; i++)
+        if (resources->crtcs[i] == crtc_id) crtc_index = i;
+    if (crtc_index < 0) return 0;
+
+    uint32_t plane_id = 0;
+    drmModePlaneRes *planes = drmModeGetPlaneResources(fd);
+    for (uint32_t i = 0; planes && i < planes->count_planes && !plane_id; i++) {
+        drmModePlane *plane = drmModeGetPlane(fd, planes->planes[i]);
+        if (plane && (plane->possible_crtcs & (1u << crtc_index))) {
+            drmModeObjectProperties *props =
+                drmModeObjectGetProperties(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+            for (uint32_t k = 0; props && k < props->count_props; k++) {
+                drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[k]);
+                if (prop && !strcmp(prop->name, "type") &&
+                    props->prop_values[k] == DRM_PLANE_TYPE_PRIMARY)
+                    plane_id = plane->plane_id;
+                drmModeFreeProperty(prop);
+            }
+            drmModeFreeObjectProperties(props);
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    return plane_id;
+}
+
+// Enables atomic KMS and resolves everything a commit needs. The
+// configuration itself is checked with TEST_ONLY on the first present,
+// when there is a framebuffer to test with.
+static void atomic_init(GraphicsContext *gfx, drmModeRes *resources)
+{
+    int fd = gfx->drm_fd;
+
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+        drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        printf("atomic: not supported, using legacy KMS\n");
+        return;
+    }
+
+    gfx->plane_id = find_primary_plane(fd, resources, gfx->crtc_id);
+    if (!gfx->plane_id) {
+        printf("atomic: no primary plane for CRTC %u, using legacy KMS\n", gfx->crtc_id);
+        return;
+    }
+
+    gfx->plane_prop.fb_id   = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+    gfx->plane_prop.crtc_id = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+    gfx->plane_prop.src_x   = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X");
+    gfx->plane_prop.src_y   = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+    gfx->plane_prop.src_w   = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W");
+    gfx->plane_prop.src_h   = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H");
+    gfx->plane_prop.crtc_x  = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+    gfx->plane_prop.crtc_y  = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+    gfx->plane_prop.crtc_w  = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+    gfx->plane_prop.crtc_h  = find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+    gfx->plane_prop.in_fence_fd =
+        find_property(fd, gfx->plane_id, DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD");
+
+    gfx->crtc_prop.mode_id = find_property(fd, gfx->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+    gfx->crtc_prop.active  = find_property(fd, gfx->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+    gfx->crtc_prop.out_fence_ptr =
+        find_property(fd, gfx->crtc_id, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+
+    gfx->connector_prop.crtc_id =
+        find_property(fd, gfx->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+
+    if (!gfx->plane_prop.fb_id || !gfx->plane_prop.crtc_id ||
+        !gfx->plane_prop.src_w || !gfx->plane_prop.crtc_w ||
+        !gfx->crtc_prop.mode_id || !gfx->crtc_prop.active ||
+        !gfx->connector_prop.crtc_id) {
+        printf("atomic: missing properties, using legacy KMS\n");
+        return;
+    }
+
+    if (drmModeCreatePropertyBlob(fd, &gfx->mode, sizeof(gfx->mode), &gfx->mode_blob_id)) {
+        perror("drmModeCreatePropertyBlob");
+        return;
+    }
+
+    gfx->use_atomic = 1;
+    printf("atomic: plane %u on CRTC %u (IN_FENCE_FD %s, OUT_FENCE_PTR %s)\n",
+           gfx->plane_id, gfx->crtc_id,
+           gfx->plane_prop.in_fence_fd ? "yes" : "no",
+           gfx->crtc_prop.out_fence_ptr ? "yes" : "no");
+}
+
+// One atomic commit showing fb_id on the primary plane. The first commit
+// also sets the mode and routes connector -> CRTC -> plane; later ones only
+// swap FB_ID, like a page flip.
+static int atomic_commit(GraphicsContext *gfx, uint32_t fb_id, uint32_t flags)
+{
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    uint32_t plane = gfx->plane_id;
+
+    drmModeAtomicAddProperty(req, plane, gfx->plane_prop.fb_id, fb_id);
+
+    if (!gfx->did_modeset) {
+        drmModeAtomicAddProperty(req, gfx->connector_id, gfx->connector_prop.crtc_id, gfx->crtc_id);
+        drmModeAtomicAddProperty(req, gfx->crtc_id, gfx->crtc_prop.mode_id, gfx->mode_blob_id);
+        drmModeAtomicAddProperty(req, gfx->crtc_id, gfx->crtc_prop.active, 1);
+
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.crtc_id, gfx->crtc_id);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.src_x, 0);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.src_y, 0);
+        // source coordinates are 16.16 fixed point
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.src_w, (uint64_t)gfx->screen_width << 16);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.src_h, (uint64_t)gfx->screen_height << 16);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.crtc_x, 0);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.crtc_y, 0);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.crtc_w, gfx->screen_width);
+        drmModeAtomicAddProperty(req, plane, gfx->plane_prop.crtc_h, gfx->screen_height);
+        flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+    }
 
-    gfx.drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+    int ret = drmModeAtomicCommit(gfx->drm_fd, req, flags, gfx);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+// KMS display, GBM surface and EGL window surface on it
+static void display_init(GraphicsContext *gfx, const backend_t *backend, int legacy)
+{
+    gfx->drm_fd = backend_open(backend);
 
-    drmModeRes *resources = drmModeGetResources(gfx.drm_fd);
-    gfx.connector = drmModeGetConnector(gfx.drm_fd, resources->connectors[0]);
-    gfx.mode = gfx.connector->modes[0];
-    gfx.encoder = drmModeGetEncoder(gfx.drm_fd, gfx.connector->encoder_id);
+    drmModeRes *resources = drmModeGetResources(gfx->drm_fd);
+    gfx->connector = backend_output(gfx->drm_fd, resources, &gfx->crtc_id);
+    gfx->mode = gfx->connector->modes[0];
 
-    gfx.screen_width  = gfx.mode.hdisplay;
-    gfx.screen_height = gfx.mode.vdisplay;
+    gfx->screen_width  = gfx->mode.hdisplay;
+    gfx->screen_height = gfx->mode.vdisplay;
 
-    gfx.crtc_id = gfx.encoder->crtc_id;
-    gfx.connector_id = gfx.connector->connector_id;
+    gfx->connector_id = gfx->connector->connector_id;
 
-    gfx.gbm_device = gbm_create_device(gfx.drm_fd);
+    if (!legacy)
+        atomic_init(gfx, resources);
 
-    gfx.egl_display = eglGetDisplay((EGLNativeDisplayType)gfx.gbm_device);
-    eglInitialize(gfx.egl_display, 0, 0);
+    gfx->gbm_device = gbm_create_device(gfx->drm_fd);
+
+    gfx->egl_display = eglGetDisplay((EGLNativeDisplayType)gfx->gbm_device);
+    eglInitialize(gfx->egl_display, 0, 0);
     eglBindAPI(EGL_OPENGL_ES_API);
 
     EGLint config_attributes[] = {
@@ -172,46 +337,62 @@ static GraphicsContext graphics_init(void)
     };
 
     EGLint num_configs;
-    eglChooseConfig(gfx.egl_display, config_attributes, &gfx.egl_config, 1, &num_configs);
+    eglChooseConfig(gfx->egl_display, config_attributes, &gfx->egl_config, 1, &num_configs);
 
     EGLint format;
-    eglGetConfigAttrib(gfx.egl_display, gfx.egl_config, EGL_NATIVE_VISUAL_ID, &format);
+    eglGetConfigAttrib(gfx->egl_display, gfx->egl_config, EGL_NATIVE_VISUAL_ID, &format);
 
-    gfx.gbm_surface = gbm_surface_create(
-        gfx.gbm_device,
-        gfx.screen_width,
-        gfx.screen_height,
+    gfx->gbm_surface = gbm_surface_create(
+        gfx->gbm_device,
+        gfx->screen_width,
+        gfx->screen_height,
         format,
         GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
     );
 
-    gfx.egl_context = eglCreateContext(
-        gfx.egl_display,
-        gfx.egl_config,
+    gfx->egl_context = eglCreateContext(
+        gfx->egl_display,
+        gfx->egl_config,
         EGL_NO_CONTEXT,
         (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
     );
 
-    gfx.egl_surface = eglCreateWindowSurface(
-        gfx.egl_display,
-        gfx.egl_config,
-        (EGLNativeWindowType)gfx.gbm_surface,
+    gfx->egl_surface = eglCreateWindowSurface(
+        gfx->egl_display,
+        gfx->egl_config,
+        (EGLNativeWindowType)gfx->gbm_surface,
         0
     );
 
-    eglMakeCurrent(gfx.egl_display,
-                   gfx.egl_surface,
-                   gfx.egl_surface,
-                   gfx.egl_context);
+    eglMakeCurrent(gfx->egl_display,
+                   gfx->egl_surface,
+                   gfx->egl_surface,
+                   gfx->egl_context);
+}
+
+static GraphicsContext graphics_init(const backend_t *backend, int legacy)
+{
+    GraphicsContext gfx = {0};
+
+    if (backend->kind == BACKEND_HEADLESS) {
+        gfx.headless = 1;
+        gfx.screen_width  = backend->width;
+        gfx.screen_height = backend->height;
+        backend_egl_headless(backend, 0, &gfx.egl_display, &gfx.egl_config,
+                             &gfx.egl_context, &gfx.egl_surface);
+    } else {
+        display_init(&gfx, backend, legacy);
+    }
 
     const char *vertex_shader_source =
         "#version 300 es\n"
         "layout(location=0) in vec2 position;"
         "layout(location=1) in vec4 color;"
+        "uniform vec4 pixel_to_ndc;"
         "out vec4 vColor;"
         "void main(){"
         "vColor = color;"
-        "gl_Position = vec4(position,0.0,1.0);"
+        "gl_Position = vec4(position*pixel_to_ndc.xy + pixel_to_ndc.zw,0.0,1.0);"
         "}";
 
     const char *fragment_shader_source =
@@ -228,16 +409,22 @@ static GraphicsContext graphics_init(void)
 
     glUseProgram(gfx.shader_program);
 
+    // pixel (0,0) is the top left corner
+    glUniform4f(glGetUniformLocation(gfx.shader_program, "pixel_to_ndc"),
+                2.0f / (gfx.screen_width - 1), -2.0f / (gfx.screen_height - 1), -1.0f, 1.0f);
+
     glGenVertexArrays(1, &gfx.vertex_array_object);
     glBindVertexArray(gfx.vertex_array_object);
 
     glGenBuffers(1, &gfx.vertex_buffer_object);
     glBindBuffer(GL_ARRAY_BUFFER, gfx.vertex_buffer_object);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, x));
     glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, rgba));
     glEnableVertexAttribArray(1);
 
     glViewport(0, 0, gfx.screen_width, gfx.screen_height);
@@ -247,109 +434,501 @@ static GraphicsContext graphics_init(void)
     return gfx;
 }
 
-static void graphics_present(GraphicsContext *gfx)
+// Puts fb on screen: the first call sets the mode, later ones flip on
+// vblank and wait for the flip event.
+static void kms_show(GraphicsContext *gfx, uint32_t fb)
 {
-    // after eglSwapBuffers(): lock next front buffer
-    double a = get_seconds();
-    struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
-    double b = get_seconds();
-
-    uint32_t new_fb = get_or_create_fb(gfx, new_bo);
-    double c = get_seconds();
     if (!gfx->did_modeset) {
-        drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, new_fb, 0, 0,
-                       &gfx->connector_id, 1, &gfx->mode);
+        // validate the whole configuration before touching the display
+        if (gfx->use_atomic &&
+            (atomic_commit(gfx, fb, DRM_MODE_ATOMIC_TEST_ONLY) || atomic_commit(gfx, fb, 0))) {
+            printf("atomic: modeset rejected, using legacy KMS\n");
+            gfx->use_atomic = 0;
+        }
+        if (!gfx->use_atomic)
+            drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, fb, 0, 0,
+                           &gfx->connector_id, 1, &gfx->mode);
         gfx->did_modeset = 1;
+        return;
+    }
+
+    gfx->flip_done = 0;
+    if (gfx->use_atomic) {
+        if (atomic_commit(gfx, fb, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT)) {
+            perror("drmModeAtomicCommit");
+            exit(1);
+        }
     } else {
-        gfx->flip_done = 0;
-        drmModePageFlip(gfx->drm_fd, gfx->crtc_id, new_fb,
+        drmModePageFlip(gfx->drm_fd, gfx->crtc_id, fb,
                         DRM_MODE_PAGE_FLIP_EVENT, gfx);
-        wait_for_flip(gfx);
     }
-    double d = get_seconds();
+    wait_for_flip(gfx);
+}
+
+static void graphics_present(GraphicsContext *gfx)
+{
+    if (gfx->headless) {
+        // nothing to flip; wait for the GPU as a flip would
+        glFinish();
+        return;
+    }
+    // after eglSwapBuffers(): lock next front buffer
+    gfx->t_lock[0] = get_seconds();
+    struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
+    gfx->t_lock[1] = get_seconds();
+
+    uint32_t new_fb = get_or_create_fb(gfx, new_bo);
+    gfx->t_flip[0] = get_seconds();
+    kms_show(gfx, new_fb);
+    gfx->t_flip[1] = get_seconds();
 
     // now safe: release previous BO (FB is freed when BO is destroyed via user_data callback)
     if (gfx->previous_bo)
         gbm_surface_release_buffer(gfx->gbm_surface, gfx->previous_bo);
 
     gfx->previous_bo = new_bo;
-    printf("present breakdown: lock=%.3fms flipwait=%.3fms\n",(b-a)*1000.0, (d-c)*1000.0);
 }
 
-int main(void)
+/* ---------- Frame pacing ---------- */
+
+// Headroom on top of the estimated frame cost: commit latency in the
+// kernel plus scheduling jitter.
+#define PACE_MARGIN 0.001
+
+// Vblank model and frame cost estimate for just-in-time rendering. The
+// period is learned from flip timestamps (the vblank counter covers flips
+// that skipped vblanks), the cost is a rolling mean plus deviation of how
+// long a frame takes from start to submit. A paced frame starts 'budget'
+// before the first vblank it can still make, so the samples it shows are
+// as fresh as possible.
+typedef struct {
+    double period;        // estimated vblank period, 0 until two flips seen
+    double vblank;        // timestamp of the last flip
+    unsigned int sequence;
+    double cost;          // rolling frame cost
+    double cost_dev;      // rolling mean deviation of the cost
+    double target;        // vblank the last paced frame was aimed at
+} pacer_t;
+
+static void pacer_flip(pacer_t *p, unsigned int sequence, double t)
+{
+    if (p->vblank > 0.0 && sequence != p->sequence) {
+        double sample = (t - p->vblank) / (unsigned int)(sequence - p->sequence);
+        p->period = p->period > 0.0 ? p->period + (sample - p->period) / 16.0 : sample;
+    }
+    p->vblank = t;
+    p->sequence = sequence;
+}
+
+static void pacer_frame_cost(pacer_t *p, double cost)
+{
+    if (p->cost == 0.0) p->cost = cost;
+    double diff = cost - p->cost;
+    p->cost += diff / 8.0;
+    p->cost_dev += ((diff < 0 ? -diff : diff) - p->cost_dev) / 8.0;
+}
+
+static double pacer_budget(const pacer_t *p)
+{
+    return p->cost + 4.0 * p->cost_dev + PACE_MARGIN;
+}
+
+// Picks the vblank the next frame aims at and returns when to start it:
+// the first predicted vblank after the previous target that is still
+// reachable from 'now'. Returns 'now' while the period is unknown.
+static double pacer_next_start(pacer_t *p, double now)
+{
+    if (p->period <= 0.0) {
+        p->target = 0.0;
+        return now;
+    }
+    double budget = pacer_budget(p);
+    double n = ceil((now + budget - p->vblank) / p->period);
+    if (n < 1.0) n = 1.0;
+    double target = p->vblank + n * p->period;
+    while (target < p->target + 0.5 * p->period)
+        target += p->period;
+    p->target = target;
+    return target - budget;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* ---------- Present thread ---------- */
+
+// Locked BOs waiting for the present thread. Two queued frames plus the one
+// on screen, the one being flipped to and the one being rendered use up the
+// four buffers a Mesa gbm_surface has.
+#define PRESENT_QUEUE_DEPTH 2
+
+enum { PRESENT_SYNC, PRESENT_FIFO, PRESENT_MAILBOX };
+
+typedef struct {
+    struct gbm_bo *bo;
+    double start;             // frame start, i.e. when its samples were taken
+    double target;            // vblank it was paced for, 0 if not paced
+} present_frame_t;
+
+// The render thread locks each new front buffer and queues it; the present
+// thread flips to it and hands the previous one back. All gbm_surface calls
+// stay on the render thread: BOs to release are only collected in
+// 'released' and given back to the surface in present_reclaim().
+typedef struct {
+    GraphicsContext *gfx;
+    int mode;                 // PRESENT_FIFO or PRESENT_MAILBOX
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // queue or released list changed
+
+    present_frame_t queue[PRESENT_QUEUE_DEPTH];
+    int head, count;
+    int flipping;             // present thread is showing a frame
+    pacer_t pacer;            // fed with every flip timestamp
+
+    struct gbm_bo *released[PRESENT_QUEUE_DEPTH + 2];
+    int released_count;
+
+    // statistics, reset by the reporting code
+    uint32_t submitted;       // frames queued
+    uint32_t presented;       // flips completed
+    uint32_t dropped;         // replaced in the mailbox before being shown
+    uint32_t depth_sum;       // queue depth seen by each submit
+    int depth_max;
+    uint32_t missed;          // paced frames shown after their target vblank
+    double latency_sum;       // frame start to flip, over 'presented'
+} present_queue_t;
+
+static void *present_thread(void *arg)
+{
+    present_queue_t *pq = arg;
+    GraphicsContext *gfx = pq->gfx;
+
+    for (;;) {
+        pthread_mutex_lock(&pq->lock);
+        while (!pq->count)
+            pthread_cond_wait(&pq->cond, &pq->lock);
+        present_frame_t frame = pq->queue[pq->head];
+        pq->head = (pq->head + 1) % PRESENT_QUEUE_DEPTH;
+        pq->count--;
+        pq->flipping = 1;
+        pthread_cond_broadcast(&pq->cond);
+        pthread_mutex_unlock(&pq->lock);
+
+        kms_show(gfx, get_or_create_fb(gfx, frame.bo));
+
+        // the old front buffer is off screen now
+        pthread_mutex_lock(&pq->lock);
+        if (gfx->previous_bo)
+            pq->released[pq->released_count++] = gfx->previous_bo;
+        gfx->previous_bo = frame.bo;
+        pq->flipping = 0;
+        pq->presented++;
+
+        pacer_flip(&pq->pacer, gfx->flip_sequence, gfx->flip_time);
+        pq->latency_sum += gfx->flip_time - frame.start;
+        if (frame.target > 0.0 && gfx->flip_time > frame.target + 0.5 * pq->pacer.period)
+            pq->missed++;
+        pthread_cond_broadcast(&pq->cond);
+        pthread_mutex_unlock(&pq->lock);
+    }
+    return NULL;
+}
+
+// Starts presenting from a thread; the first frame must already be on
+// screen (gfx->previous_bo) via graphics_present().
+static void present_start(present_queue_t *pq, GraphicsContext *gfx, int mode)
+{
+    *pq = (present_queue_t){ .gfx = gfx, .mode = mode };
+    pthread_mutex_init(&pq->lock, NULL);
+    pthread_cond_init(&pq->cond, NULL);
+    pthread_create(&pq->thread, NULL, present_thread, pq);
+}
+
+// Gives BOs the present thread is done with back to the surface and makes
+// sure eglSwapBuffers() will find a free buffer. Call before rendering.
+static void present_reclaim(present_queue_t *pq)
+{
+    pthread_mutex_lock(&pq->lock);
+    for (;;) {
+        for (int i = 0; i < pq->released_count; i++)
+            gbm_surface_release_buffer(pq->gfx->gbm_surface, pq->released[i]);
+        pq->released_count = 0;
+        if (gbm_surface_has_free_buffers(pq->gfx->gbm_surface))
+            break;
+        pthread_cond_wait(&pq->cond, &pq->lock);
+    }
+    pthread_mutex_unlock(&pq->lock);
+}
+
+// Starts time for the next paced frame and the vblank it aims at. Frames
+// still queued would delay it by a refresh each, so they are let through
+// first; in steady state the queue is already empty at this point.
+static double present_pace(present_queue_t *pq, double *target)
 {
-    GraphicsContext gfx = graphics_init();
+    pthread_mutex_lock(&pq->lock);
+    while (pq->count || pq->flipping)
+        pthread_cond_wait(&pq->cond, &pq->lock);
+    double start = pacer_next_start(&pq->pacer, get_seconds());
+    *target = pq->pacer.target;
+    pthread_mutex_unlock(&pq->lock);
+    return start;
+}
+
+// Locks the frame just finished with eglSwapBuffers() and queues it. FIFO
+// waits for a free slot, so every frame is shown; mailbox replaces frames
+// still waiting, so the newest one is shown and the render thread never
+// blocks. 'start' and 'target' are only used for statistics.
+static void present_submit(present_queue_t *pq, double start, double target)
+{
+    struct gbm_bo *bo = gbm_surface_lock_front_buffer(pq->gfx->gbm_surface);
+
+    pthread_mutex_lock(&pq->lock);
+    if (pq->mode == PRESENT_MAILBOX) {
+        while (pq->count) {
+            pq->released[pq->released_count++] = pq->queue[pq->head].bo;
+            pq->head = (pq->head + 1) % PRESENT_QUEUE_DEPTH;
+            pq->count--;
+            pq->dropped++;
+        }
+    } else {
+        while (pq->count == PRESENT_QUEUE_DEPTH)
+            pthread_cond_wait(&pq->cond, &pq->lock);
+    }
+
+    pq->depth_sum += pq->count;
+    if (pq->count > pq->depth_max) pq->depth_max = pq->count;
+
+    pq->queue[(pq->head + pq->count) % PRESENT_QUEUE_DEPTH] =
+        (present_frame_t){ .bo = bo, .start = start, .target = target };
+    pq->count++;
+    pq->submitted++;
+    pthread_cond_broadcast(&pq->cond);
+    pthread_mutex_unlock(&pq->lock);
+}
+
+enum { STAGE_GENERATE, STAGE_RECLAIM, STAGE_DRAW, STAGE_PRESENT, STAGE_FRAME,
+       STAGE_LOCK, STAGE_FLIP, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "generate vertices", "buffer wait", "draw and swap", "present / submit", "frame",
+    "lock front buffer", "flip wait",
+};
+
+int main(int argc, char **argv)
+{
+    double t_launch = get_seconds();
+    uint64_t seed = (uint64_t)time(0);
+    backend_t backend = BACKEND_DEFAULT;
+    int legacy = 0;
+    int present_mode = PRESENT_FIFO;
+    int paced = 0;
+    bench_t bench = { .program = argv[0] };
+    int opt;
+    while ((opt = getopt(argc, argv, "s:lp:PB:b:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'l': legacy = 1; break;
+        case 'p':
+            if      (!strcmp(optarg, "sync"))    present_mode = PRESENT_SYNC;
+            else if (!strcmp(optarg, "fifo"))    present_mode = PRESENT_FIFO;
+            else if (!strcmp(optarg, "mailbox")) present_mode = PRESENT_MAILBOX;
+            else goto usage;
+            break;
+        case 'P': paced = 1; break;
+        case 'B':
+            if (!backend_parse(&backend, optarg)) goto usage;
+            break;
+        case 'b':
+            if (!bench_parse(&bench, optarg)) goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-s seed] [-l] [-p sync|fifo|mailbox] [-P]\n"
+                            "          [-B " BACKEND_USAGE "]\n"
+                            "          [-b " BENCH_USAGE "]\n"
+                            "  -l  legacy SetCrtc/PageFlip instead of atomic KMS\n"
+                            "  -p  sync:    flip and wait in the render loop, one frame per second\n"
+                            "      fifo:    present thread, every frame shown (default)\n"
+                            "      mailbox: present thread, newest frame shown, stale ones dropped\n"
+                            "  -P  pace frames: start each one just in time for the next vblank\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+    if (bench.scenario) seed = bench.seed;
 
-    int line_count = 100000;
+    GraphicsContext gfx = graphics_init(&backend, legacy);
+    // no flips to queue or pace without a display
+    if (gfx.headless) {
+        present_mode = PRESENT_SYNC;
+        paced = 0;
+    }
+    // the draw call below is disabled, so this measures generation, upload
+    // and presentation of the frames
+    snprintf(bench.renderer, sizeof(bench.renderer), "present %s%s",
+             present_mode == PRESENT_SYNC ? "sync" : present_mode == PRESENT_FIFO ? "fifo" : "mailbox",
+             paced ? " paced" : "");
+    if (bench.scenario)
+        bench_gl_line_width(&bench);
+
+    int line_count = scenario->lines;
     int vertices_per_line = 2;
     int total_vertices = line_count * vertices_per_line;
-    int floats_per_vertex = 6;
 
-    size_t vertex_buffer_size = (size_t)total_vertices * (size_t)floats_per_vertex * sizeof(float);
+    size_t vertex_stride = sizeof(line_vertex_t);
+    size_t vertex_buffer_size = (size_t)total_vertices * vertex_stride;
 
-    float *vertex_data = malloc(vertex_buffer_size);
+    vertex_ring_t ring;
+    vertex_ring_init(&ring, vertex_buffer_size);
 
-    glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, 0, GL_STREAM_DRAW);
+    rng_t rng;
+    rng_seed(&rng, seed);
+    printf("Seed: %" PRIu64 "\n", seed);
 
-    srandom(time(0));
+    // random words for the next RNG_BATCH lines: x0 y0 x1 y1 rgb
+    uint32_t rnd[5 * RNG_BATCH];
 
     glClear(GL_COLOR_BUFFER_BIT);
     eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
     graphics_present(&gfx);
+    // cold start: process entry to the first (blank) frame on screen
+    printf("First Frame: %.6f sec (programs %.6f sec, %d cached, %d compiled)\n",
+           get_seconds() - t_launch, program_stats.seconds,
+           program_stats.loaded, program_stats.compiled);
+
+    present_queue_t pq;
+    if (present_mode != PRESENT_SYNC)
+        present_start(&pq, &gfx, present_mode);
+    else if (paced) {
+        printf("pacing needs a present thread, ignoring -P\n");
+        paced = 0;
+    }
+
+    // Stage times go into histograms, see stage-timing.h. With a present
+    // thread the loop runs flat out, -p sync draws one frame per second.
+    stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+    double t_report = get_seconds();
+    uint32_t frames = 0;
 
     for (;;)
     {
+        double target = 0.0;
+        if (paced)
+            sleep_until(present_pace(&pq, &target));
+
         double t0 = get_seconds();
+        int64_t pixels = 0;
+        line_vertex_t *vertex_data = vertex_ring_begin(&ring);
         for (int i = 0; i < line_count; i++)
         {
-            int x0 = random() % gfx.screen_width;
-            int y0 = random() % gfx.screen_height;
-            int x1 = random() % gfx.screen_width;
-            int y1 = random() % gfx.screen_height;
-
-            float fx0 = 2.0f * x0 / (gfx.screen_width - 1) - 1.0f;
-            float fy0 = 1.0f - 2.0f * y0 / (gfx.screen_height - 1);
-
-            float fx1 = 2.0f * x1 / (gfx.screen_width - 1) - 1.0f;
-            float fy1 = 1.0f - 2.0f * y1 / (gfx.screen_height - 1);
-
-            float r = (random() % 256) / 255.0f;
-            float g = (random() % 256) / 255.0f;
-            float b = (random() % 256) / 255.0f;
-
-            int base = i * vertices_per_line * floats_per_vertex;
-
-            vertex_data[base + 0]  = fx0;
-            vertex_data[base + 1]  = fy0;
-            vertex_data[base + 2]  = r;
-            vertex_data[base + 3]  = g;
-            vertex_data[base + 4]  = b;
-            vertex_data[base + 5]  = 1.0f;
-
-            vertex_data[base + 6]  = fx1;
-            vertex_data[base + 7]  = fy1;
-            vertex_data[base + 8]  = r;
-            vertex_data[base + 9]  = g;
-            vertex_data[base + 10] = b;
-            vertex_data[base + 11] = 1.0f;
+            if (i % RNG_BATCH == 0)
+                rng_fill(&rng, rnd, 5 * RNG_BATCH);
+            const uint32_t *q = &rnd[5 * (i % RNG_BATCH)];
+
+            // x0 y0 x1 y1
+            int p[4];
+            pixels += bench_line(scenario, q, gfx.screen_width, gfx.screen_height, p);
+
+            // alpha forced to 255
+            uint32_t rgba = q[4] | 0xFF000000u;
+
+            line_vertex_t *v = &vertex_data[i * vertices_per_line];
+            v[0] = (line_vertex_t){ (int16_t)p[0], (int16_t)p[1], rgba };
+            v[1] = (line_vertex_t){ (int16_t)p[2], (int16_t)p[3], rgba };
         }
+        vertex_ring_end(&ring);
         double t1 = get_seconds();
 
+        if (present_mode != PRESENT_SYNC)
+            present_reclaim(&pq);
+        double tb = get_seconds();
+
         glClear(GL_COLOR_BUFFER_BIT);
-        glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, NULL, GL_STREAM_DRAW); // orphan
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertex_data);
-        //glDrawArrays(GL_LINES, 0, total_vertices);
+        //glDrawArrays(GL_LINES, vertex_ring_first(&ring, vertex_stride), total_vertices);
+        vertex_ring_fence(&ring);
 
         eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
         double t2 = get_seconds();        
-        graphics_present(&gfx);
+        if (present_mode == PRESENT_SYNC)
+            graphics_present(&gfx);
+        else
+            present_submit(&pq, t0, target);
         double t3 = get_seconds();
-        printf("Create Vert: %.6f sec \n", (t1 - t0));
-        printf("Draw Lines : %.6f sec \n", (t2 - t1));
-        printf("Flip new   : %.6f sec \n", (t3 - t2));
-        printf("Total Time : %.6f sec \n \n", (t3 - t0));
-        sleep(1);
+        frames++;
+
+        if (paced) {
+            pthread_mutex_lock(&pq.lock);
+            pacer_frame_cost(&pq.pacer, t3 - t0);
+            pthread_mutex_unlock(&pq.lock);
+        }
+
+        stage_record(st, STAGE_GENERATE, 0, t0, t1);
+        if (present_mode != PRESENT_SYNC)
+            stage_record(st, STAGE_RECLAIM, 0, t1, tb);
+        stage_record(st, STAGE_DRAW, 0, tb, t2);
+        stage_record(st, STAGE_PRESENT, 0, t2, t3);
+        stage_record(st, STAGE_FRAME, 0, t0, t3);
+        if (present_mode == PRESENT_SYNC && !gfx.headless) {
+            stage_record(st, STAGE_LOCK, 0, gfx.t_lock[0], gfx.t_lock[1]);
+            stage_record(st, STAGE_FLIP, 0, gfx.t_flip[0], gfx.t_flip[1]);
+        }
+
+        if (bench.scenario) {
+            if (!bench_frame(&bench, t3 - t0, (double)pixels)) {
+                bench_report(&bench, gfx.screen_width, gfx.screen_height);
+                return 0;
+            }
+            continue;
+        }
+
+        int poll = stage_poll(st);
+        if (poll == STAGE_STOP)
+            break;
+        if (poll == STAGE_REPORT) {
+            printf("Ring Stalls: %" PRIu32 " (%.6f sec) \n", ring.stalls, ring.wait_time);
+            ring.stalls = 0;
+            ring.wait_time = 0.0;
+        }
+        if (poll == STAGE_REPORT && present_mode != PRESENT_SYNC) {
+            pthread_mutex_lock(&pq.lock);
+            uint32_t presented = pq.presented, dropped = pq.dropped;
+            double depth_avg = pq.submitted ? (double)pq.depth_sum / pq.submitted : 0.0;
+            int depth_max = pq.depth_max;
+            uint32_t missed = pq.missed;
+            double latency = presented ? pq.latency_sum / presented : 0.0;
+            pacer_t pacer = pq.pacer;
+            pq.submitted = pq.presented = pq.dropped = pq.depth_sum = pq.missed = 0;
+            pq.depth_max = 0;
+            pq.latency_sum = 0.0;
+            pthread_mutex_unlock(&pq.lock);
+
+            printf("Frames/sec : %.2f rendered, %.2f presented \n",
+                   frames / (t3 - t_report), presented / (t3 - t_report));
+            printf("Queue      : depth avg %.2f max %d, %" PRIu32 " dropped \n",
+                   depth_avg, depth_max, dropped);
+            printf("Latency    : %.3f ms frame start to flip \n", latency * 1000.0);
+            if (paced)
+                printf("Pacing     : vblank %.3f ms, budget %.3f ms, %" PRIu32 " missed \n",
+                       pacer.period * 1000.0, pacer_budget(&pacer) * 1000.0, missed);
+            t_report = t3;
+            frames = 0;
+        }
+        if (poll == STAGE_REPORT)
+            printf("\n");
+        if (present_mode == PRESENT_SYNC)
+            sleep(1);
     }
 
+    stage_finish(st);
     return 0;
 }
@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <getopt.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -16,14 +19,29 @@
 #include <EGL/egl.h>
 #include <GLES3/gl3.h>
 
+#include "fast-rand.h"
+#include "vertex-ring.h"
+#include "gl-program.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "stage-timing.h"
+#include "gpu-timing.h"
+
+// 8-byte vertex: position in pixels, RGBA8 color with R in the low byte
+typedef struct {
+    int16_t x, y;
+    uint32_t rgba;
+} line_vertex_t;
+
 typedef struct {
     int drm_fd;
+    int headless;       // -B headless: pbuffer, no KMS
     int screen_width;
     int screen_height;
 
     drmModeModeInfo mode;
     drmModeConnector *connector;
-    drmModeEncoder   *encoder;
+    uint32_t crtc_id;
 
     struct gbm_device  *gbm_device;
     struct gbm_surface *gbm_surface;
@@ -48,41 +66,22 @@ static inline double get_seconds()
    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static GLuint create_shader(GLenum type, const char *source)
+// KMS display, GBM surface and EGL window surface on it
+static void display_init(GraphicsContext *gfx, const backend_t *backend)
 {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, 0);
-    glCompileShader(shader);
-    return shader;
-}
+    gfx->drm_fd = backend_open(backend);
 
-static GLuint create_program(const char *vs, const char *fs)
-{
-    GLuint program = glCreateProgram();
-    glAttachShader(program, create_shader(GL_VERTEX_SHADER, vs));
-    glAttachShader(program, create_shader(GL_FRAGMENT_SHADER, fs));
-    glLinkProgram(program);
-    return program;
-}
-
-static GraphicsContext graphics_init(void)
-{
-    GraphicsContext gfx = {0};
+    drmModeRes *resources = drmModeGetResources(gfx->drm_fd);
+    gfx->connector = backend_output(gfx->drm_fd, resources, &gfx->crtc_id);
+    gfx->mode = gfx->connector->modes[0];
 
-    gfx.drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+    gfx->screen_width  = gfx->mode.hdisplay;
+    gfx->screen_height = gfx->mode.vdisplay;
 
-    drmModeRes *resources = drmModeGetResources(gfx.drm_fd);
-    gfx.connector = drmModeGetConnector(gfx.drm_fd, resources->connectors[0]);
-    gfx.mode = gfx.connector->modes[0];
-    gfx.encoder = drmModeGetEncoder(gfx.drm_fd, gfx.connector->encoder_id);
+    gfx->gbm_device = gbm_create_device(gfx->drm_fd);
 
-    gfx.screen_width  = gfx.mode.hdisplay;
-    gfx.screen_height = gfx.mode.vdisplay;
-
-    gfx.gbm_device = gbm_create_device(gfx.drm_fd);
-
-    gfx.egl_display = eglGetDisplay((EGLNativeDisplayType)gfx.gbm_device);
-    eglInitialize(gfx.egl_display, 0, 0);
+    gfx->egl_display = eglGetDisplay((EGLNativeDisplayType)gfx->gbm_device);
+    eglInitialize(gfx->egl_display, 0, 0);
     eglBindAPI(EGL_OPENGL_ES_API);
 
     EGLint config_attributes[] = {
@@ -96,46 +95,62 @@ static GraphicsContext graphics_init(void)
     };
 
     EGLint num_configs;
-    eglChooseConfig(gfx.egl_display, config_attributes, &gfx.egl_config, 1, &num_configs);
+    eglChooseConfig(gfx->egl_display, config_attributes, &gfx->egl_config, 1, &num_configs);
 
     EGLint format;
-    eglGetConfigAttrib(gfx.egl_display, gfx.egl_config, EGL_NATIVE_VISUAL_ID, &format);
+    eglGetConfigAttrib(gfx->egl_display, gfx->egl_config, EGL_NATIVE_VISUAL_ID, &format);
 
-    gfx.gbm_surface = gbm_surface_create(
-        gfx.gbm_device,
-        gfx.screen_width,
-        gfx.screen_height,
+    gfx->gbm_surface = gbm_surface_create(
+        gfx->gbm_device,
+        gfx->screen_width,
+        gfx->screen_height,
         format,
         GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
     );
 
-    gfx.egl_context = eglCreateContext(
-        gfx.egl_display,
-        gfx.egl_config,
+    gfx->egl_context = eglCreateContext(
+        gfx->egl_display,
+        gfx->egl_config,
         EGL_NO_CONTEXT,
         (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
     );
 
-    gfx.egl_surface = eglCreateWindowSurface(
-        gfx.egl_display,
-        gfx.egl_config,
-        (EGLNativeWindowType)gfx.gbm_surface,
+    gfx->egl_surface = eglCreateWindowSurface(
+        gfx->egl_display,
+        gfx->egl_config,
+        (EGLNativeWindowType)gfx->gbm_surface,
         0
     );
 
-    eglMakeCurrent(gfx.egl_display,
-                   gfx.egl_surface,
-                   gfx.egl_surface,
-                   gfx.egl_context);
+    eglMakeCurrent(gfx->egl_display,
+                   gfx->egl_surface,
+                   gfx->egl_surface,
+                   gfx->egl_context);
+}
+
+static GraphicsContext graphics_init(const backend_t *backend)
+{
+    GraphicsContext gfx = {0};
+
+    if (backend->kind == BACKEND_HEADLESS) {
+        gfx.headless = 1;
+        gfx.screen_width  = backend->width;
+        gfx.screen_height = backend->height;
+        backend_egl_headless(backend, 0, &gfx.egl_display, &gfx.egl_config,
+                             &gfx.egl_context, &gfx.egl_surface);
+    } else {
+        display_init(&gfx, backend);
+    }
 
     const char *vertex_shader_source =
         "#version 300 es\n"
         "layout(location=0) in vec2 position;"
         "layout(location=1) in vec4 color;"
+        "uniform vec4 pixel_to_ndc;"
         "out vec4 vColor;"
         "void main(){"
         "vColor = color;"
-        "gl_Position = vec4(position,0.0,1.0);"
+        "gl_Position = vec4(position*pixel_to_ndc.xy + pixel_to_ndc.zw,0.0,1.0);"
         "}";
 
     const char *fragment_shader_source =
@@ -152,16 +167,22 @@ static GraphicsContext graphics_init(void)
 
     glUseProgram(gfx.shader_program);
 
+    // pixel (0,0) is the top left corner
+    glUniform4f(glGetUniformLocation(gfx.shader_program, "pixel_to_ndc"),
+                2.0f / (gfx.screen_width - 1), -2.0f / (gfx.screen_height - 1), -1.0f, 1.0f);
+
     glGenVertexArrays(1, &gfx.vertex_array_object);
     glBindVertexArray(gfx.vertex_array_object);
 
     glGenBuffers(1, &gfx.vertex_buffer_object);
     glBindBuffer(GL_ARRAY_BUFFER, gfx.vertex_buffer_object);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, x));
     glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(line_vertex_t),
+                          (void*)offsetof(line_vertex_t, rgba));
     glEnableVertexAttribArray(1);
 
     glViewport(0, 0, gfx.screen_width, gfx.screen_height);
@@ -173,6 +194,11 @@ static GraphicsContext graphics_init(void)
 
 static void graphics_present(GraphicsContext *gfx)
 {
+    if (gfx->headless) {
+        // nothing to flip; wait for the GPU as a flip would
+        glFinish();
+        return;
+    }
     struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
 
     uint32_t new_fb;
@@ -180,7 +206,7 @@ static void graphics_present(GraphicsContext *gfx)
                  24, 32, gbm_bo_get_stride(new_bo),gbm_bo_get_handle(new_bo).u32,
                  &new_fb);
 
-    drmModeSetCrtc(gfx->drm_fd, gfx->encoder->crtc_id, new_fb, 0, 0,
+    drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, new_fb, 0, 0,
                    &gfx->connector->connector_id, 1, &gfx->mode);
 
     if (gfx->previous_framebuffer) drmModeRmFB(gfx->drm_fd, gfx->previous_framebuffer);
@@ -190,84 +216,136 @@ static void graphics_present(GraphicsContext *gfx)
     gfx->previous_framebuffer = new_fb;
 }
 
-int main(void)
+enum { STAGE_GENERATE, STAGE_DRAW, STAGE_PRESENT, STAGE_FRAME, STAGE_GPU, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "generate vertices", "draw and swap", "present", "frame", "gpu execution",
+};
+
+int main(int argc, char **argv)
 {
-    GraphicsContext gfx = graphics_init();
+    double t_launch = get_seconds();
+    uint64_t seed = (uint64_t)time(0);
+    backend_t backend = BACKEND_DEFAULT;
+    bench_t bench = { .program = argv[0], .renderer = "gl lines" };
+    int opt;
+    while ((opt = getopt(argc, argv, "s:B:b:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'B':
+            if (!backend_parse(&backend, optarg)) goto usage;
+            break;
+        case 'b':
+            if (!bench_parse(&bench, optarg)) goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-s seed] [-B " BACKEND_USAGE "]\n"
+                            "          [-b " BENCH_USAGE "]\n", argv[0]);
+            return 1;
+        }
+    }
+    const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+    if (bench.scenario) seed = bench.seed;
+
+    GraphicsContext gfx = graphics_init(&backend);
+    if (bench.scenario)
+        bench_gl_line_width(&bench);
 
-    int line_count = 100000;
+    int line_count = scenario->lines;
     int vertices_per_line = 2;
     int total_vertices = line_count * vertices_per_line;
-    int floats_per_vertex = 6;
 
-    size_t vertex_buffer_size = (size_t)total_vertices * (size_t)floats_per_vertex * sizeof(float);
+    size_t vertex_stride = sizeof(line_vertex_t);
+    size_t vertex_buffer_size = (size_t)total_vertices * vertex_stride;
 
-    float *vertex_data = malloc(vertex_buffer_size);
+    vertex_ring_t ring;
+    vertex_ring_init(&ring, vertex_buffer_size);
 
-    glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, 0, GL_STREAM_DRAW);
+    rng_t rng;
+    rng_seed(&rng, seed);
+    printf("Seed: %" PRIu64 "\n", seed);
 
-    srandom(time(0));
+    // random words for the next RNG_BATCH lines: x0 y0 x1 y1 rgb
+    uint32_t rnd[5 * RNG_BATCH];
 
     glClear(GL_COLOR_BUFFER_BIT);
     eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
     graphics_present(&gfx);
+    // cold start: process entry to the first (blank) frame on screen
+    printf("First Frame: %.6f sec (programs %.6f sec, %d cached, %d compiled)\n",
+           get_seconds() - t_launch, program_stats.seconds,
+           program_stats.loaded, program_stats.compiled);
+
+    // stage times go into histograms, see stage-timing.h
+    stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+    // GPU side of each frame and its overlap with the CPU, see gpu-timing.h
+    gpu_timer_t gpu;
+    gpu_timer_init(&gpu, st, STAGE_GPU);
 
     for (;;)
     {
         double t0 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        int64_t pixels = 0;
+        line_vertex_t *vertex_data = vertex_ring_begin(&ring);
         for (int i = 0; i < line_count; i++)
         {
-            int x0 = random() % gfx.screen_width;
-            int y0 = random() % gfx.screen_height;
-            int x1 = random() % gfx.screen_width;
-            int y1 = random() % gfx.screen_height;
-
-            float fx0 = 2.0f * x0 / (gfx.screen_width - 1) - 1.0f;
-            float fy0 = 1.0f - 2.0f * y0 / (gfx.screen_height - 1);
-
-            float fx1 = 2.0f * x1 / (gfx.screen_width - 1) - 1.0f;
-            float fy1 = 1.0f - 2.0f * y1 / (gfx.screen_height - 1);
-
-            float r = (random() % 256) / 255.0f;
-            float g = (random() % 256) / 255.0f;
-            float b = (random() % 256) / 255.0f;
-
-            int base = i * vertices_per_line * floats_per_vertex;
-
-            vertex_data[base + 0]  = fx0;
-            vertex_data[base + 1]  = fy0;
-            vertex_data[base + 2]  = r;
-            vertex_data[base + 3]  = g;
-            vertex_data[base + 4]  = b;
-            vertex_data[base + 5]  = 1.0f;
-
-            vertex_data[base + 6]  = fx1;
-            vertex_data[base + 7]  = fy1;
-            vertex_data[base + 8]  = r;
-            vertex_data[base + 9]  = g;
-            vertex_data[base + 10] = b;
-            vertex_data[base + 11] = 1.0f;
+            if (i % RNG_BATCH == 0)
+                rng_fill(&rng, rnd, 5 * RNG_BATCH);
+            const uint32_t *q = &rnd[5 * (i % RNG_BATCH)];
+
+            // x0 y0 x1 y1
+            int p[4];
+            pixels += bench_line(scenario, q, gfx.screen_width, gfx.screen_height, p);
+
+            // alpha forced to 255
+            uint32_t rgba = q[4] | 0xFF000000u;
+
+            line_vertex_t *v = &vertex_data[i * vertices_per_line];
+            v[0] = (line_vertex_t){ (int16_t)p[0], (int16_t)p[1], rgba };
+            v[1] = (line_vertex_t){ (int16_t)p[2], (int16_t)p[3], rgba };
         }
+        vertex_ring_end(&ring);
         double t1 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        gpu_timer_begin(&gpu);
         glClear(GL_COLOR_BUFFER_BIT);
-        glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, NULL, GL_STREAM_DRAW); // orphan
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertex_data);
-        glDrawArrays(GL_LINES, 0, total_vertices);
+        glDrawArrays(GL_LINES, vertex_ring_first(&ring, vertex_stride), total_vertices);
+        vertex_ring_fence(&ring);
+        gpu_timer_end(&gpu, t0);
 
         eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
-        double t2 = get_seconds ();
-        graphics_present(&gfx);
-<<<<<<< HEAD
-
         double t2 = get_seconds();
-=======
+        gpu_timer_poll(&gpu, 0);
+        graphics_present(&gfx);
         double t3 = get_seconds();
->>>>>>> 70161c8 (lokales Update)
-        printf("Create Vert: %.6f sec \n", (t1 - t0));
-        printf("Draw Lines : %.6f sec \n", (t2 - t1));
-        printf("Present    : %.6f sec \n", (t3 - t2));
-        printf("Total Time : %.6f sec \n \n", (t3 - t0));
-        sleep(1);
+        gpu_timer_poll(&gpu, 0);
+        stage_record(st, STAGE_GENERATE, 0, t0, t1);
+        stage_record(st, STAGE_DRAW, 0, t1, t2);
+        stage_record(st, STAGE_PRESENT, 0, t2, t3);
+        stage_record(st, STAGE_FRAME, 0, t0, t3);
+
+        if (bench.scenario) {
+            if (!bench_frame(&bench, t3 - t0, (double)pixels)) {
+                bench_report(&bench, gfx.screen_width, gfx.screen_height);
+                return 0;
+            }
+            continue;
+        }
+
+        int poll = stage_poll(st);
+        if (poll == STAGE_STOP)
+            break;
+        if (poll == STAGE_REPORT) {
+            printf("Ring Stalls: %" PRIu32 " (%.6f sec) \n", ring.stalls, ring.wait_time);
+            gpu_timer_report(&gpu);
+            printf("\n");
+            ring.stalls = 0;
+            ring.wait_time = 0.0;
+        }
     }
 
+    stage_finish(st);
     return 0;
 }
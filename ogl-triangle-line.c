@@ -1,399 +1,733 @@
-// Build:
-// gcc ogl-min-line-perf-pageflip.c -o ogl-min-line-perf-pageflip \
-//         $(pkg-config --cflags --libs egl glesv2 gbm libdrm)
-
-#include <fcntl.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <time.h>
-#include <stdint.h>
-#include <sys/select.h>
-
-#include <xf86drm.h>
-#include <xf86drmMode.h>
-#include <drm_fourcc.h>
-#include <gbm.h>
-#include <EGL/egl.h>
-#include <GLES3/gl3.h>
-
-typedef struct {
-    int drm_fd;
-    int screen_width;
-    int screen_height;
-
-    drmModeModeInfo mode;
-    drmModeConnector *connector;
-    drmModeEncoder   *encoder;
-
-    struct gbm_device  *gbm_device;
-    struct gbm_surface *gbm_surface;
-    struct gbm_bo *previous_bo;
-
-    uint32_t crtc_id;
-    uint32_t connector_id;
-    int did_modeset;
-
-    volatile int flip_done;
-
-    EGLDisplay egl_display;
-    EGLConfig  egl_config;
-    EGLContext egl_context;
-    EGLSurface egl_surface;
-
-    GLuint shader_program;
-    GLuint vertex_array_object;
-    GLuint vertex_buffer_object;
-
-} GraphicsContext;
-
-static inline double get_seconds()
-{
-   struct timespec ts;
-   clock_gettime(CLOCK_MONOTONIC,&ts);
-   return ts.tv_sec + ts.tv_nsec * 1e-9;
-}
-
-static GLuint create_shader(GLenum type, const char *source)
-{
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, 0);
-    glCompileShader(shader);
-    return shader;
-}
-
-static GLuint create_program(const char *vs, const char *fs)
-{
-    GLuint program = glCreateProgram();
-    glAttachShader(program, create_shader(GL_VERTEX_SHADER, vs));
-    glAttachShader(program, create_shader(GL_FRAGMENT_SHADER, fs));
-    glLinkProgram(program);
-    return program;
-}
-
-/* ---------- Pageflip event ---------- */
-
-static void page_flip_handler(int fd, unsigned int frame,
-                              unsigned int sec, unsigned int usec,
-                              void *data)
-{
-    (void)fd; (void)frame; (void)sec; (void)usec;
-    ((GraphicsContext*)data)->flip_done = 1;
-}
-
-static void wait_for_flip(GraphicsContext *gfx)
-{
-    drmEventContext ev = (drmEventContext){0};
-    ev.version = DRM_EVENT_CONTEXT_VERSION;
-    ev.page_flip_handler = page_flip_handler;
-
-    while (!gfx->flip_done) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(gfx->drm_fd, &fds);
-        select(gfx->drm_fd + 1, &fds, NULL, NULL, NULL);
-        drmHandleEvent(gfx->drm_fd, &ev);
-    }
-    gfx->flip_done = 0;
-}
-
-/* ---------- FB caching per GBM BO ---------- */
-
-typedef struct {
-    int drm_fd;
-    uint32_t fb_id;
-} FbData;
-
-static void fbdata_destroy(struct gbm_bo *bo, void *data)
-{
-    (void)bo;
-    FbData *d = (FbData*)data;
-    if (d) {
-        if (d->fb_id) drmModeRmFB(d->drm_fd, d->fb_id);
-        free(d);
-    }
-}
-
-static uint32_t get_or_create_fb(GraphicsContext *gfx, struct gbm_bo *bo)
-{
-    FbData *d = (FbData*)gbm_bo_get_user_data(bo);
-    if (d) return d->fb_id;
-
-    d = (FbData*)calloc(1, sizeof(*d));
-    d->drm_fd = gfx->drm_fd;
-
-    uint32_t handles[4] = { gbm_bo_get_handle(bo).u32, 0, 0, 0 };
-    uint32_t strides[4] = { gbm_bo_get_stride(bo), 0, 0, 0 };
-    uint32_t offsets[4] = { 0, 0, 0, 0 };
-
-    int ret = drmModeAddFB2(gfx->drm_fd, gfx->screen_width, gfx->screen_height,
-                            DRM_FORMAT_XRGB8888, handles, strides, offsets,
-                            &d->fb_id, 0);
-    if (ret) {
-        perror("drmModeAddFB2");
-        exit(1);
-    }
-
-    gbm_bo_set_user_data(bo, d, fbdata_destroy);
-    return d->fb_id;
-}
-
-static GraphicsContext graphics_init(void)
-{
-    GraphicsContext gfx = {0};
-
-    gfx.drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
-
-    drmModeRes *resources = drmModeGetResources(gfx.drm_fd);
-    gfx.connector = drmModeGetConnector(gfx.drm_fd, resources->connectors[0]);
-    gfx.mode = gfx.connector->modes[0];
-    gfx.encoder = drmModeGetEncoder(gfx.drm_fd, gfx.connector->encoder_id);
-
-    gfx.screen_width  = gfx.mode.hdisplay;
-    gfx.screen_height = gfx.mode.vdisplay;
-
-    gfx.crtc_id = gfx.encoder->crtc_id;
-    gfx.connector_id = gfx.connector->connector_id;
-
-    gfx.gbm_device = gbm_create_device(gfx.drm_fd);
-
-    gfx.egl_display = eglGetDisplay((EGLNativeDisplayType)gfx.gbm_device);
-    eglInitialize(gfx.egl_display, 0, 0);
-    eglBindAPI(EGL_OPENGL_ES_API);
-
-    EGLint config_attributes[] = {
-        EGL_SURFACE_TYPE,    EGL_WINDOW_BIT,
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
-        EGL_RED_SIZE,   8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE,  8,
-        EGL_ALPHA_SIZE, 8,
-        EGL_NONE
-    };
-
-    EGLint num_configs;
-    eglChooseConfig(gfx.egl_display, config_attributes, &gfx.egl_config, 1, &num_configs);
-
-    EGLint format;
-    eglGetConfigAttrib(gfx.egl_display, gfx.egl_config, EGL_NATIVE_VISUAL_ID, &format);
-
-    gfx.gbm_surface = gbm_surface_create(
-        gfx.gbm_device,
-        gfx.screen_width,
-        gfx.screen_height,
-        format,
-        GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
-    );
-
-    gfx.egl_context = eglCreateContext(
-        gfx.egl_display,
-        gfx.egl_config,
-        EGL_NO_CONTEXT,
-        (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
-    );
-
-    gfx.egl_surface = eglCreateWindowSurface(
-        gfx.egl_display,
-        gfx.egl_config,
-        (EGLNativeWindowType)gfx.gbm_surface,
-        0
-    );
-
-    eglMakeCurrent(gfx.egl_display,
-                   gfx.egl_surface,
-                   gfx.egl_surface,
-                   gfx.egl_context);
-
-    const char *vertex_shader_source =
-        "#version 300 es\n"
-        "layout(location=0) in vec2 position;"
-        "layout(location=1) in vec4 color;"
-        "out vec4 vColor;"
-        "void main(){"
-        "vColor = color;"
-        "gl_Position = vec4(position,0.0,1.0);"
-        "}";
-
-    const char *fragment_shader_source =
-        "#version 300 es\n"
-        "precision mediump float;"
-        "in vec4 vColor;"
-        "out vec4 fragColor;"
-        "void main(){"
-        "fragColor = vColor;"
-        "}";
-
-    gfx.shader_program = create_program(vertex_shader_source,
-                                        fragment_shader_source);
-
-    glUseProgram(gfx.shader_program);
-
-    glGenVertexArrays(1, &gfx.vertex_array_object);
-    glBindVertexArray(gfx.vertex_array_object);
-
-    glGenBuffers(1, &gfx.vertex_buffer_object);
-    glBindBuffer(GL_ARRAY_BUFFER, gfx.vertex_buffer_object);
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
-    glEnableVertexAttribArray(0);
-
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-
-    glViewport(0, 0, gfx.screen_width, gfx.screen_height);
-
-    eglSwapInterval(gfx.egl_display, 0);
-
-    return gfx;
-}
-
-static void graphics_present(GraphicsContext *gfx)
-{
-    // after eglSwapBuffers(): lock next front buffer
-    double a = get_seconds();
-    struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
-    double b = get_seconds();
-
-    uint32_t new_fb = get_or_create_fb(gfx, new_bo);
-    double c = get_seconds();
-    if (!gfx->did_modeset) {
-        drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, new_fb, 0, 0,
-                       &gfx->connector_id, 1, &gfx->mode);
-        gfx->did_modeset = 1;
-    } else {
-        gfx->flip_done = 0;
-        drmModePageFlip(gfx->drm_fd, gfx->crtc_id, new_fb,
-                        DRM_MODE_PAGE_FLIP_EVENT, gfx);
-        wait_for_flip(gfx);
-    }
-    double d = get_seconds();
-
-    // now safe: release previous BO (FB is freed when BO is destroyed via user_data callback)
-    if (gfx->previous_bo)
-        gbm_surface_release_buffer(gfx->gbm_surface, gfx->previous_bo);
-
-    gfx->previous_bo = new_bo;
-    printf("present breakdown: lock=%.3fms flipwait=%.3fms\n",(b-a)*1000.0, (d-c)*1000.0);
-}
-
-int main(void)
-{
-    GraphicsContext gfx = graphics_init();
-
-    int line_count = 100000;
-
-    // each line -> 2 triangles -> 6 vertices
-    int vertices_per_line = 6;
-    int total_vertices = line_count * vertices_per_line;
-    int floats_per_vertex = 6;
-
-    size_t vertex_buffer_size = (size_t)total_vertices * (size_t)floats_per_vertex * sizeof(float);
-    float *vertex_data = malloc(vertex_buffer_size);
-
-    glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, 0, GL_STREAM_DRAW);
-
-    srandom(time(0));
-
-    glClear(GL_COLOR_BUFFER_BIT);
-    eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
-    graphics_present(&gfx);
-
-    // line width in pixels
-    float line_width_px = 2.0f;
-
-    // pixel -> NDC scale (anisotropic to match screen aspect)
-    float sx = 2.0f / (float)gfx.screen_width;
-    float sy = 2.0f / (float)gfx.screen_height;
-
-    for (;;)
-    {
-        double t0 = get_seconds();
-
-        for (int i = 0; i < line_count; i++)
-        {
-            int x0 = random() % gfx.screen_width;
-            int y0 = random() % gfx.screen_height;
-            int x1 = random() % gfx.screen_width;
-            int y1 = random() % gfx.screen_height;
-
-            // endpoints in NDC
-            float p0x = 2.0f * x0 / (gfx.screen_width  - 1) - 1.0f;
-            float p0y = 1.0f - 2.0f * y0 / (gfx.screen_height - 1);
-            float p1x = 2.0f * x1 / (gfx.screen_width  - 1) - 1.0f;
-            float p1y = 1.0f - 2.0f * y1 / (gfx.screen_height - 1);
-
-            // direction in NDC
-            float dx = p1x - p0x;
-            float dy = p1y - p0y;
-
-            // normalize (avoid div0)
-            float len2 = dx*dx + dy*dy;
-            float invlen = (len2 > 1e-12f) ? (1.0f / sqrtf(len2)) : 0.0f;
-            dx *= invlen;
-            dy *= invlen;
-
-            // perpendicular, scaled to ~line_width_px (account for NDC scaling)
-            // n = (-dy, dx) then scale with pixel->NDC and half-width
-            float nx = -dy * sx * (line_width_px * 0.5f);
-            float ny =  dx * sy * (line_width_px * 0.5f);
-
-            // quad corners
-            float Ax = p0x + nx, Ay = p0y + ny;
-            float Bx = p0x - nx, By = p0y - ny;
-            float Cx = p1x + nx, Cy = p1y + ny;
-            float Dx = p1x - nx, Dy = p1y - ny;
-
-            float r = (random() % 256) / 255.0f;
-            float g = (random() % 256) / 255.0f;
-            float b = (random() % 256) / 255.0f;
-
-            int base = i * vertices_per_line * floats_per_vertex;
-
-            // tri 1: A, B, C
-            vertex_data[base +  0] = Ax; vertex_data[base +  1] = Ay;
-            vertex_data[base +  2] = r;  vertex_data[base +  3] = g;
-            vertex_data[base +  4] = b;  vertex_data[base +  5] = 1.0f;
-
-            vertex_data[base +  6] = Bx; vertex_data[base +  7] = By;
-            vertex_data[base +  8] = r;  vertex_data[base +  9] = g;
-            vertex_data[base + 10] = b;  vertex_data[base + 11] = 1.0f;
-
-            vertex_data[base + 12] = Cx; vertex_data[base + 13] = Cy;
-            vertex_data[base + 14] = r;  vertex_data[base + 15] = g;
-            vertex_data[base + 16] = b;  vertex_data[base + 17] = 1.0f;
-
-            // tri 2: C, B, D
-            vertex_data[base + 18] = Cx; vertex_data[base + 19] = Cy;
-            vertex_data[base + 20] = r;  vertex_data[base + 21] = g;
-            vertex_data[base + 22] = b;  vertex_data[base + 23] = 1.0f;
-
-            vertex_data[base + 24] = Bx; vertex_data[base + 25] = By;
-            vertex_data[base + 26] = r;  vertex_data[base + 27] = g;
-            vertex_data[base + 28] = b;  vertex_data[base + 29] = 1.0f;
-
-            vertex_data[base + 30] = Dx; vertex_data[base + 31] = Dy;
-            vertex_data[base + 32] = r;  vertex_data[base + 33] = g;
-            vertex_data[base + 34] = b;  vertex_data[base + 35] = 1.0f;
-        }
-
-        double t1 = get_seconds();
-
-        glClear(GL_COLOR_BUFFER_BIT);
-        glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, NULL, GL_STREAM_DRAW); // orphan
-        glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertex_data);
-        glDrawArrays(GL_TRIANGLES, 0, total_vertices);
-
-        eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
-        graphics_present(&gfx);
-
-        double t2 = get_seconds();
-
-        printf("Create Vert: %.6f sec \n", (t1 - t0));
-        printf("Draw Tris  : %.6f sec \n", (t2 - t1));
-        printf("Total Time : %.6f sec \n \n", (t2 - t0));
-
-        sleep(1);
-    }
-
-    return 0;
+// Build:
+// gcc ogl-min-line-perf-pageflip.c -o ogl-min-line-perf-pageflip \
+//         $(pkg-config --cflags --libs egl glesv2 gbm libdrm) -lm
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <sys/select.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <gbm.h>
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+
+#include "fast-rand.h"
+#include "vertex-ring.h"
+#include "gl-program.h"
+#include "display-backend.h"
+#include "bench.h"
+#include "stage-timing.h"
+#include "gpu-timing.h"
+
+// One thick line for the instanced renderer, 16 bytes instead of the
+// 6 vertices x 6 floats (144 bytes) of the CPU-expanded quad.
+typedef struct {
+    int16_t x0, y0, x1, y1;   // endpoints in pixels
+    uint32_t rgba;            // RGBA8, R in the low byte
+    uint16_t width;           // line width in 1/16 pixel
+    uint16_t pad;
+} line_instance_t;
+
+enum { CAP_BUTT, CAP_SQUARE, CAP_ROUND };
+
+enum { AA_OFF, AA_ON, AA_COMPARE };
+
+typedef struct {
+    int drm_fd;
+    int headless;       // -B headless: pbuffer, no KMS
+    int screen_width;
+    int screen_height;
+
+    drmModeModeInfo mode;
+    drmModeConnector *connector;
+
+    struct gbm_device  *gbm_device;
+    struct gbm_surface *gbm_surface;
+    struct gbm_bo *previous_bo;
+    double t_lock[2];             // last graphics_present(): front buffer lock
+    double t_flip[2];             // and modeset / flip until it completed
+
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    int did_modeset;
+
+    volatile int flip_done;
+
+    EGLDisplay egl_display;
+    EGLConfig  egl_config;
+    EGLContext egl_context;
+    EGLSurface egl_surface;
+
+    GLuint shader_program;
+    GLuint vertex_array_object;
+    GLuint vertex_buffer_object;
+
+    // instanced thick lines: quad corners built from gl_VertexID
+    GLuint line_program;
+    GLuint line_vertex_array_object;
+    GLuint line_buffer_object;
+
+} GraphicsContext;
+
+static inline double get_seconds()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ---------- Pageflip event ---------- */
+
+static void page_flip_handler(int fd, unsigned int frame,
+                              unsigned int sec, unsigned int usec,
+                              void *data)
+{
+    (void)fd; (void)frame; (void)sec; (void)usec;
+    ((GraphicsContext*)data)->flip_done = 1;
+}
+
+static void wait_for_flip(GraphicsContext *gfx)
+{
+    drmEventContext ev = (drmEventContext){0};
+    ev.version = DRM_EVENT_CONTEXT_VERSION;
+    ev.page_flip_handler = page_flip_handler;
+
+    while (!gfx->flip_done) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(gfx->drm_fd, &fds);
+        select(gfx->drm_fd + 1, &fds, NULL, NULL, NULL);
+        drmHandleEvent(gfx->drm_fd, &ev);
+    }
+    gfx->flip_done = 0;
+}
+
+/* ---------- FB caching per GBM BO ---------- */
+
+typedef struct {
+    int drm_fd;
+    uint32_t fb_id;
+} FbData;
+
+static void fbdata_destroy(struct gbm_bo *bo, void *data)
+{
+    (void)bo;
+    FbData *d = (FbData*)data;
+    if (d) {
+        if (d->fb_id) drmModeRmFB(d->drm_fd, d->fb_id);
+        free(d);
+    }
+}
+
+static uint32_t get_or_create_fb(GraphicsContext *gfx, struct gbm_bo *bo)
+{
+    FbData *d = (FbData*)gbm_bo_get_user_data(bo);
+    if (d) return d->fb_id;
+
+    d = (FbData*)calloc(1, sizeof(*d));
+    d->drm_fd = gfx->drm_fd;
+
+    uint32_t handles[4] = { gbm_bo_get_handle(bo).u32, 0, 0, 0 };
+    uint32_t strides[4] = { gbm_bo_get_stride(bo), 0, 0, 0 };
+    uint32_t offsets[4] = { 0, 0, 0, 0 };
+
+    int ret = drmModeAddFB2(gfx->drm_fd, gfx->screen_width, gfx->screen_height,
+                            DRM_FORMAT_XRGB8888, handles, strides, offsets,
+                            &d->fb_id, 0);
+    if (ret) {
+        perror("drmModeAddFB2");
+        exit(1);
+    }
+
+    gbm_bo_set_user_data(bo, d, fbdata_destroy);
+    return d->fb_id;
+}
+
+// Points the per-instance attributes at the ring region being drawn; GLES3
+// has no base instance, so the offset goes into the pointers instead.
+static void line_instance_pointers(size_t offset)
+{
+    const GLsizei stride = sizeof(line_instance_t);
+    glVertexAttribPointer(0, 4, GL_SHORT, GL_FALSE, stride,
+                          (void*)(offset + offsetof(line_instance_t, x0)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          (void*)(offset + offsetof(line_instance_t, rgba)));
+    glVertexAttribPointer(2, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+                          (void*)(offset + offsetof(line_instance_t, width)));
+}
+
+// Program and VAO for the instanced renderer. Each instance is drawn as two
+// triangles; square and round caps extend the quad by half the width along
+// the line, round caps then discard fragments outside the end circles.
+//
+// With antialiasing the quad grows by a one pixel fringe and the fragment
+// shader turns the distance to the line's edge into coverage, blended as
+// alpha. That smooths thin traces without MSAA's extra tile memory.
+static void line_instanced_init(GraphicsContext *gfx, int cap)
+{
+    const char *vertex_shader_source =
+        "#version 300 es\n"
+        "layout(location=0) in vec4 endpoints;"
+        "layout(location=1) in vec4 color;"
+        "layout(location=2) in float width;"
+        "uniform vec4 pixel_to_ndc;"
+        "uniform float cap_extend;"
+        "uniform bool antialias;"
+        "out vec4 vColor;"
+        "out vec3 vLocal;"
+        "out float vHalfWidth;"
+        "const float corner_t[6] = float[6](0.0, 0.0, 1.0, 1.0, 0.0, 1.0);"
+        "const float corner_s[6] = float[6](1.0, -1.0, 1.0, 1.0, -1.0, -1.0);"
+        "void main(){"
+        "vec2 d = endpoints.zw - endpoints.xy;"
+        "float len = length(d);"
+        "vec2 dir = len > 0.0 ? d / len : vec2(1.0, 0.0);"
+        "vec2 n = vec2(-dir.y, dir.x);"
+        "float hw = width * (0.5 / 16.0);"
+        "float fringe = antialias ? 1.0 : 0.0;"
+        "float ext = hw * cap_extend + fringe;"
+        "float along = mix(-ext, len + ext, corner_t[gl_VertexID]);"
+        "float across = (hw + fringe) * corner_s[gl_VertexID];"
+        "vec2 p = endpoints.xy + dir * along + n * across;"
+        "vColor = color;"
+        "vLocal = vec3(along, across, len);"
+        "vHalfWidth = hw;"
+        "gl_Position = vec4(p*pixel_to_ndc.xy + pixel_to_ndc.zw,0.0,1.0);"
+        "}";
+
+    const char *fragment_shader_source =
+        "#version 300 es\n"
+        "precision highp float;"
+        "in vec4 vColor;"
+        "in vec3 vLocal;"
+        "in float vHalfWidth;"
+        "uniform bool round_caps;"
+        "uniform bool antialias;"
+        "uniform float cap_extend;"
+        "out vec4 fragColor;"
+        "void main(){"
+        // distance beyond the segment ends along the line
+        "float a = vLocal.x < 0.0 ? -vLocal.x : max(vLocal.x - vLocal.z, 0.0);"
+        "if (!antialias) {"
+        "if (round_caps && a*a + vLocal.y*vLocal.y > vHalfWidth*vHalfWidth) discard;"
+        "fragColor = vColor;"
+        "return;"
+        "}"
+        "float coverage;"
+        "if (round_caps) {"
+        "coverage = vHalfWidth + 0.5 - length(vec2(a, vLocal.y));"
+        "} else {"
+        "coverage = min(vHalfWidth + 0.5 - abs(vLocal.y),"
+        "               vHalfWidth * cap_extend + 0.5 - a);"
+        "}"
+        "coverage = clamp(coverage, 0.0, 1.0);"
+        "if (coverage <= 0.0) discard;"
+        "fragColor = vec4(vColor.rgb, vColor.a * coverage);"
+        "}";
+
+    gfx->line_program = create_program(vertex_shader_source,
+                                       fragment_shader_source);
+    glUseProgram(gfx->line_program);
+
+    // pixel (0,0) is the top left corner
+    glUniform4f(glGetUniformLocation(gfx->line_program, "pixel_to_ndc"),
+                2.0f / (gfx->screen_width - 1), -2.0f / (gfx->screen_height - 1), -1.0f, 1.0f);
+    glUniform1f(glGetUniformLocation(gfx->line_program, "cap_extend"),
+                cap == CAP_BUTT ? 0.0f : 1.0f);
+    glUniform1i(glGetUniformLocation(gfx->line_program, "round_caps"), cap == CAP_ROUND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glGenVertexArrays(1, &gfx->line_vertex_array_object);
+    glBindVertexArray(gfx->line_vertex_array_object);
+
+    glGenBuffers(1, &gfx->line_buffer_object);
+    glBindBuffer(GL_ARRAY_BUFFER, gfx->line_buffer_object);
+
+    line_instance_pointers(0);
+    for (GLuint i = 0; i < 3; i++) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+}
+
+// Switches between aliased and antialiased (blended) thick lines.
+static void line_antialias(GraphicsContext *gfx, int on)
+{
+    glUniform1i(glGetUniformLocation(gfx->line_program, "antialias"), on);
+    if (on) glEnable(GL_BLEND);
+    else    glDisable(GL_BLEND);
+}
+
+// KMS display, GBM surface and EGL window surface on it
+static void display_init(GraphicsContext *gfx, const backend_t *backend)
+{
+    gfx->drm_fd = backend_open(backend);
+
+    drmModeRes *resources = drmModeGetResources(gfx->drm_fd);
+    gfx->connector = backend_output(gfx->drm_fd, resources, &gfx->crtc_id);
+    gfx->mode = gfx->connector->modes[0];
+
+    gfx->screen_width  = gfx->mode.hdisplay;
+    gfx->screen_height = gfx->mode.vdisplay;
+
+    gfx->connector_id = gfx->connector->connector_id;
+
+    gfx->gbm_device = gbm_create_device(gfx->drm_fd);
+
+    gfx->egl_display = eglGetDisplay((EGLNativeDisplayType)gfx->gbm_device);
+    eglInitialize(gfx->egl_display, 0, 0);
+    eglBindAPI(EGL_OPENGL_ES_API);
+
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE,    EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+        EGL_RED_SIZE,   8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE,  8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE
+    };
+
+    EGLint num_configs;
+    eglChooseConfig(gfx->egl_display, config_attributes, &gfx->egl_config, 1, &num_configs);
+
+    EGLint format;
+    eglGetConfigAttrib(gfx->egl_display, gfx->egl_config, EGL_NATIVE_VISUAL_ID, &format);
+
+    gfx->gbm_surface = gbm_surface_create(
+        gfx->gbm_device,
+        gfx->screen_width,
+        gfx->screen_height,
+        format,
+        GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING
+    );
+
+    gfx->egl_context = eglCreateContext(
+        gfx->egl_display,
+        gfx->egl_config,
+        EGL_NO_CONTEXT,
+        (EGLint[]){ EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE }
+    );
+
+    gfx->egl_surface = eglCreateWindowSurface(
+        gfx->egl_display,
+        gfx->egl_config,
+        (EGLNativeWindowType)gfx->gbm_surface,
+        0
+    );
+
+    eglMakeCurrent(gfx->egl_display,
+                   gfx->egl_surface,
+                   gfx->egl_surface,
+                   gfx->egl_context);
+}
+
+static GraphicsContext graphics_init(const backend_t *backend)
+{
+    GraphicsContext gfx = {0};
+
+    if (backend->kind == BACKEND_HEADLESS) {
+        gfx.headless = 1;
+        gfx.screen_width  = backend->width;
+        gfx.screen_height = backend->height;
+        backend_egl_headless(backend, 0, &gfx.egl_display, &gfx.egl_config,
+                             &gfx.egl_context, &gfx.egl_surface);
+    } else {
+        display_init(&gfx, backend);
+    }
+
+    const char *vertex_shader_source =
+        "#version 300 es\n"
+        "layout(location=0) in vec2 position;"
+        "layout(location=1) in vec4 color;"
+        "out vec4 vColor;"
+        "void main(){"
+        "vColor = color;"
+        "gl_Position = vec4(position,0.0,1.0);"
+        "}";
+
+    const char *fragment_shader_source =
+        "#version 300 es\n"
+        "precision mediump float;"
+        "in vec4 vColor;"
+        "out vec4 fragColor;"
+        "void main(){"
+        "fragColor = vColor;"
+        "}";
+
+    gfx.shader_program = create_program(vertex_shader_source,
+                                        fragment_shader_source);
+
+    glUseProgram(gfx.shader_program);
+
+    glGenVertexArrays(1, &gfx.vertex_array_object);
+    glBindVertexArray(gfx.vertex_array_object);
+
+    glGenBuffers(1, &gfx.vertex_buffer_object);
+    glBindBuffer(GL_ARRAY_BUFFER, gfx.vertex_buffer_object);
+
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+
+    glViewport(0, 0, gfx.screen_width, gfx.screen_height);
+
+    eglSwapInterval(gfx.egl_display, 0);
+
+    return gfx;
+}
+
+static void graphics_present(GraphicsContext *gfx)
+{
+    if (gfx->headless) {
+        // nothing to flip; wait for the GPU as a flip would
+        glFinish();
+        return;
+    }
+    // after eglSwapBuffers(): lock next front buffer
+    gfx->t_lock[0] = get_seconds();
+    struct gbm_bo *new_bo = gbm_surface_lock_front_buffer(gfx->gbm_surface);
+    gfx->t_lock[1] = get_seconds();
+
+    uint32_t new_fb = get_or_create_fb(gfx, new_bo);
+    gfx->t_flip[0] = get_seconds();
+    if (!gfx->did_modeset) {
+        drmModeSetCrtc(gfx->drm_fd, gfx->crtc_id, new_fb, 0, 0,
+                       &gfx->connector_id, 1, &gfx->mode);
+        gfx->did_modeset = 1;
+    } else {
+        gfx->flip_done = 0;
+        drmModePageFlip(gfx->drm_fd, gfx->crtc_id, new_fb,
+                        DRM_MODE_PAGE_FLIP_EVENT, gfx);
+        wait_for_flip(gfx);
+    }
+    gfx->t_flip[1] = get_seconds();
+
+    // now safe: release previous BO (FB is freed when BO is destroyed via user_data callback)
+    if (gfx->previous_bo)
+        gbm_surface_release_buffer(gfx->gbm_surface, gfx->previous_bo);
+
+    gfx->previous_bo = new_bo;
+}
+
+enum { RENDER_CPU, RENDER_INSTANCED };
+
+enum { STAGE_GENERATE, STAGE_DRAW, STAGE_FRAME, STAGE_GPU, STAGE_LOCK, STAGE_FLIP,
+       STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "generate lines", "draw and present", "frame", "gpu execution",
+    "lock front buffer", "flip wait",
+};
+
+int main(int argc, char **argv)
+{
+    double t_launch = get_seconds();
+    uint64_t seed = (uint64_t)time(0);
+    int render = RENDER_INSTANCED;
+    int cap = CAP_BUTT;
+    int aa = AA_OFF;
+    backend_t backend = BACKEND_DEFAULT;
+    bench_t bench = { .program = argv[0] };
+
+    // line width in pixels
+    float line_width_px = 2.0f;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:c:w:a:B:b:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'm':
+            if      (!strcmp(optarg, "cpu"))       render = RENDER_CPU;
+            else if (!strcmp(optarg, "instanced")) render = RENDER_INSTANCED;
+            else goto usage;
+            break;
+        case 'c':
+            if      (!strcmp(optarg, "butt"))   cap = CAP_BUTT;
+            else if (!strcmp(optarg, "square")) cap = CAP_SQUARE;
+            else if (!strcmp(optarg, "round"))  cap = CAP_ROUND;
+            else goto usage;
+            break;
+        case 'a':
+            if      (!strcmp(optarg, "off"))     aa = AA_OFF;
+            else if (!strcmp(optarg, "on"))      aa = AA_ON;
+            else if (!strcmp(optarg, "compare")) aa = AA_COMPARE;
+            else goto usage;
+            break;
+        case 'w':
+            line_width_px = strtof(optarg, NULL);
+            if (line_width_px <= 0.0f || line_width_px >= 4096.0f) goto usage;
+            break;
+        case 'B':
+            if (!backend_parse(&backend, optarg)) goto usage;
+            break;
+        case 'b':
+            if (!bench_parse(&bench, optarg)) goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-s seed] [-m cpu|instanced] [-c butt|square|round] [-w width]\n"
+                            "          [-a off|on|compare] [-B " BACKEND_USAGE "]\n"
+                            "          [-b " BENCH_USAGE "]\n"
+                            "  -m  cpu:       quads expanded on the CPU, butt caps only\n"
+                            "      instanced: one 16-byte record per line, quads built on the GPU (default)\n"
+                            "  -a  antialiased lines (instanced only); compare draws every frame\n"
+                            "      aliased and antialiased and prints both GPU times\n"
+                            "  -b  the scenario sets the line width and antialiasing\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    const bench_scenario_t *scenario = bench.scenario ? bench.scenario : BENCH_DEFAULT;
+    if (bench.scenario) {
+        if (aa == AA_COMPARE) {
+            fprintf(stderr, "-b measures one renderer, not -a compare\n");
+            return 1;
+        }
+        static const char *cap_names[] = { "butt", "square", "round" };
+        snprintf(bench.renderer, sizeof(bench.renderer), "%s %s",
+                 render == RENDER_CPU ? "cpu quads" : "instanced", cap_names[cap]);
+        // any width; antialiasing is done by the instanced shader only
+        bench_require(&bench, 4096.0f, render == RENDER_INSTANCED);
+        seed = bench.seed;
+        line_width_px = scenario->width;
+        aa = scenario->aa ? AA_ON : AA_OFF;
+    }
+    if (aa != AA_OFF && render == RENDER_CPU) {
+        fprintf(stderr, "antialiasing needs -m instanced\n");
+        return 1;
+    }
+
+    GraphicsContext gfx = graphics_init(&backend);
+
+    int line_count = scenario->lines;
+
+    // each line -> 2 triangles -> 6 vertices
+    int vertices_per_line = 6;
+    int total_vertices = line_count * vertices_per_line;
+    int floats_per_vertex = 6;
+
+    size_t vertex_buffer_size = (size_t)total_vertices * (size_t)floats_per_vertex * sizeof(float);
+    float *vertex_data = NULL;
+
+    vertex_ring_t ring = {0};     // instanced renderer only
+    if (render == RENDER_INSTANCED) {
+        line_instanced_init(&gfx, cap);
+        line_antialias(&gfx, aa == AA_ON);
+        vertex_ring_init(&ring, (size_t)line_count * sizeof(line_instance_t));
+    } else {
+        vertex_data = malloc(vertex_buffer_size);
+        glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, 0, GL_STREAM_DRAW);
+    }
+
+    rng_t rng;
+    rng_seed(&rng, seed);
+    printf("Seed: %" PRIu64 "\n", seed);
+    printf("Upload: %zu bytes/frame\n", render == RENDER_INSTANCED
+           ? (size_t)line_count * sizeof(line_instance_t) : vertex_buffer_size);
+
+    // random words for the next RNG_BATCH lines: x0 y0 x1 y1 rgb
+    uint32_t rnd[5 * RNG_BATCH];
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
+    graphics_present(&gfx);
+    // cold start: process entry to the first (blank) frame on screen
+    printf("First Frame: %.6f sec (programs %.6f sec, %d cached, %d compiled)\n",
+           get_seconds() - t_launch, program_stats.seconds,
+           program_stats.loaded, program_stats.compiled);
+
+    // pixel -> NDC scale (anisotropic to match screen aspect)
+    float sx = 2.0f / (float)gfx.screen_width;
+    float sy = 2.0f / (float)gfx.screen_height;
+
+    // stage times go into histograms, see stage-timing.h
+    stage_timer_t *st = stage_init(stage_names, STAGE_COUNT);
+    // GPU side of each frame and its overlap with the CPU, see gpu-timing.h
+    gpu_timer_t gpu;
+    gpu_timer_init(&gpu, st, STAGE_GPU);
+
+    for (;;)
+    {
+        double t0 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        int64_t pixels = 0;
+
+        if (render == RENDER_INSTANCED) {
+            line_instance_t *lines = vertex_ring_begin(&ring);
+            uint16_t width = (uint16_t)lrintf(line_width_px * 16.0f);
+            for (int i = 0; i < line_count; i++)
+            {
+                if (i % RNG_BATCH == 0)
+                    rng_fill(&rng, rnd, 5 * RNG_BATCH);
+                const uint32_t *q = &rnd[5 * (i % RNG_BATCH)];
+
+                // x0 y0 x1 y1
+                int p[4];
+                pixels += bench_line(scenario, q, gfx.screen_width, gfx.screen_height, p);
+
+                lines[i] = (line_instance_t){
+                    .x0 = (int16_t)p[0],
+                    .y0 = (int16_t)p[1],
+                    .x1 = (int16_t)p[2],
+                    .y1 = (int16_t)p[3],
+                    .rgba = q[4] | 0xFF000000u,
+                    .width = width,
+                };
+            }
+            vertex_ring_end(&ring);
+        } else {
+            for (int i = 0; i < line_count; i++)
+            {
+                if (i % RNG_BATCH == 0)
+                    rng_fill(&rng, rnd, 5 * RNG_BATCH);
+                const uint32_t *q = &rnd[5 * (i % RNG_BATCH)];
+
+                int p[4];
+                pixels += bench_line(scenario, q, gfx.screen_width, gfx.screen_height, p);
+                int x0 = p[0], y0 = p[1], x1 = p[2], y1 = p[3];
+
+                // endpoints in NDC
+                float p0x = 2.0f * x0 / (gfx.screen_width  - 1) - 1.0f;
+                float p0y = 1.0f - 2.0f * y0 / (gfx.screen_height - 1);
+                float p1x = 2.0f * x1 / (gfx.screen_width  - 1) - 1.0f;
+                float p1y = 1.0f - 2.0f * y1 / (gfx.screen_height - 1);
+
+                // direction in NDC
+                float dx = p1x - p0x;
+                float dy = p1y - p0y;
+
+                // normalize (avoid div0)
+                float len2 = dx*dx + dy*dy;
+                float invlen = (len2 > 1e-12f) ? (1.0f / sqrtf(len2)) : 0.0f;
+                dx *= invlen;
+                dy *= invlen;
+
+                // perpendicular, scaled to ~line_width_px (account for NDC scaling)
+                // n = (-dy, dx) then scale with pixel->NDC and half-width
+                float nx = -dy * sx * (line_width_px * 0.5f);
+                float ny =  dx * sy * (line_width_px * 0.5f);
+
+                // quad corners
+                float Ax = p0x + nx, Ay = p0y + ny;
+                float Bx = p0x - nx, By = p0y - ny;
+                float Cx = p1x + nx, Cy = p1y + ny;
+                float Dx = p1x - nx, Dy = p1y - ny;
+
+                float r = ( q[4]        & 0xFF) / 255.0f;
+                float g = ((q[4] >> 8)  & 0xFF) / 255.0f;
+                float b = ((q[4] >> 16) & 0xFF) / 255.0f;
+
+                int base = i * vertices_per_line * floats_per_vertex;
+
+                // tri 1: A, B, C
+                vertex_data[base +  0] = Ax; vertex_data[base +  1] = Ay;
+                vertex_data[base +  2] = r;  vertex_data[base +  3] = g;
+                vertex_data[base +  4] = b;  vertex_data[base +  5] = 1.0f;
+
+                vertex_data[base +  6] = Bx; vertex_data[base +  7] = By;
+                vertex_data[base +  8] = r;  vertex_data[base +  9] = g;
+                vertex_data[base + 10] = b;  vertex_data[base + 11] = 1.0f;
+
+                vertex_data[base + 12] = Cx; vertex_data[base + 13] = Cy;
+                vertex_data[base + 14] = r;  vertex_data[base + 15] = g;
+                vertex_data[base + 16] = b;  vertex_data[base + 17] = 1.0f;
+
+                // tri 2: C, B, D
+                vertex_data[base + 18] = Cx; vertex_data[base + 19] = Cy;
+                vertex_data[base + 20] = r;  vertex_data[base + 21] = g;
+                vertex_data[base + 22] = b;  vertex_data[base + 23] = 1.0f;
+
+                vertex_data[base + 24] = Bx; vertex_data[base + 25] = By;
+                vertex_data[base + 26] = r;  vertex_data[base + 27] = g;
+                vertex_data[base + 28] = b;  vertex_data[base + 29] = 1.0f;
+
+                vertex_data[base + 30] = Dx; vertex_data[base + 31] = Dy;
+                vertex_data[base + 32] = r;  vertex_data[base + 33] = g;
+                vertex_data[base + 34] = b;  vertex_data[base + 35] = 1.0f;
+            }
+        }
+
+        double t1 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+
+        gpu_timer_begin(&gpu);
+        glClear(GL_COLOR_BUFFER_BIT);
+        if (aa == AA_COMPARE) {
+            // same lines both ways, each finished on the GPU before timing
+            line_instance_pointers(ring.frame_size * ring.current);
+            line_antialias(&gfx, 0);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 6, line_count);
+            glFinish();
+            double a1 = get_seconds();
+
+            glClear(GL_COLOR_BUFFER_BIT);
+            line_antialias(&gfx, 1);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 6, line_count);
+            glFinish();
+            double a2 = get_seconds();
+            vertex_ring_fence(&ring);
+
+            printf("Aliased    : %.6f sec \n", (a1 - t1));
+            printf("Antialiased: %.6f sec (%.2fx) \n \n", (a2 - a1), (a2 - a1) / (a1 - t1));
+        } else if (render == RENDER_INSTANCED) {
+            line_instance_pointers(ring.frame_size * ring.current);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 6, line_count);
+            vertex_ring_fence(&ring);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, NULL, GL_STREAM_DRAW); // orphan
+            glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertex_data);
+            glDrawArrays(GL_TRIANGLES, 0, total_vertices);
+        }
+        gpu_timer_end(&gpu, t0);
+
+        eglSwapBuffers(gfx.egl_display, gfx.egl_surface);
+        graphics_present(&gfx);
+
+        double t2 = get_seconds();
+        gpu_timer_poll(&gpu, 0);
+        stage_record(st, STAGE_GENERATE, 0, t0, t1);
+        stage_record(st, STAGE_DRAW, 0, t1, t2);
+        stage_record(st, STAGE_FRAME, 0, t0, t2);
+        if (!gfx.headless) {
+            stage_record(st, STAGE_LOCK, 0, gfx.t_lock[0], gfx.t_lock[1]);
+            stage_record(st, STAGE_FLIP, 0, gfx.t_flip[0], gfx.t_flip[1]);
+        }
+
+        if (bench.scenario) {
+            if (!bench_frame(&bench, t2 - t0, (double)pixels)) {
+                bench_report(&bench, gfx.screen_width, gfx.screen_height);
+                return 0;
+            }
+            continue;
+        }
+
+        int poll = stage_poll(st);
+        if (poll == STAGE_STOP)
+            break;
+        if (poll == STAGE_REPORT) {
+            gpu_timer_report(&gpu);
+            printf("\n");
+        }
+        // the aliased/antialiased comparison above prints every frame
+        if (aa == AA_COMPARE)
+            sleep(1);
+    }
+
+    stage_finish(st);
+    return 0;
 }
\ No newline at end of file
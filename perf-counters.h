@@ -0,0 +1,177 @@
+// perf-counters.h
+// Hardware performance counters per render stage, per thread.
+//
+// The stage times say how long a stage takes, not why: a slow draw can be
+// cache misses on the write-combined scanout mapping or branch mispredicts in
+// the Bresenham loop. With PERF_COUNTERS=1 in the environment perf_open()
+// opens one perf_event_open() group on the calling thread:
+//
+//   cycles, instructions, L1D misses, LLC misses, branch misses
+//
+// counted in user space only (works with the default perf_event_paranoid=2),
+// for this thread only, so every worker opens its own group and gets its
+// own numbers. perf_mark(pc, stage) reads the whole group with one read()
+// and charges everything counted since the previous mark to 'stage'; mark -1
+// at the start of a frame, then each stage where it ends. perf_summary()
+// prints the mean per stage since start next to the stage time summary.
+//
+// Without PERF_COUNTERS, or where the kernel has no PMU for us (VMs,
+// perf_event_paranoid=3), everything is off and a mark is one branch. Events
+// the CPU does not count (LLC on some cores) are shown as "-". On arm64 the
+// L1D read-miss event is L1D_CACHE_REFILL, which includes write misses.
+//
+// PLOT_COUNT(n) counts plotted pixels into the thread-local plot_counter when
+// built with -DPLOT_COUNTER; by default it compiles to nothing, so no store
+// is added to the per-pixel loop.
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef PLOT_COUNTER
+static _Thread_local uint32_t plot_counter;
+#define PLOT_COUNT(n) (plot_counter += (uint32_t)(n))
+#else
+#define PLOT_COUNT(n) ((void)0)
+#endif
+
+#define PERF_STAGES 16
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES,
+       PERF_BRANCH_MISSES, PERF_COUNTERS };
+
+typedef struct {
+   int fd;                          // group leader (cycles), -1: off
+   int n;                           // events in the group
+   int event[PERF_COUNTERS];        // group position -> PERF_*
+   int open[PERF_COUNTERS];
+   uint64_t last[PERF_COUNTERS];
+   uint64_t count[PERF_STAGES];     // marks per stage
+   uint64_t sum[PERF_STAGES][PERF_COUNTERS];
+} perf_counters_t;
+
+static const struct {
+   uint32_t type;
+   uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+   { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+   { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+   { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+   { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+   { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int perf_event(int e, int group)
+{
+   struct perf_event_attr attr = {
+      .type = perf_events[e].type,
+      .size = sizeof(attr),
+      .config = perf_events[e].config,
+      .read_format = PERF_FORMAT_GROUP,
+      .disabled = group < 0,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+   };
+   // this thread, any CPU
+   return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Opens the counters of the calling thread if PERF_COUNTERS is set; pc->fd
+// stays -1 otherwise. Call it from the thread that runs the stages.
+static void perf_open(perf_counters_t *pc)
+{
+   memset(pc, 0, sizeof(*pc));
+   pc->fd = -1;
+
+   const char *env = getenv("PERF_COUNTERS");
+   if (!env || !atoi(env))
+      return;
+
+   pc->fd = perf_event(PERF_CYCLES, -1);
+   if (pc->fd < 0) {
+      static int warned;
+      if (!warned++)
+         fprintf(stderr, "perf_event_open: %s, no performance counters\n", strerror(errno));
+      return;
+   }
+   pc->event[pc->n++] = PERF_CYCLES;
+   pc->open[PERF_CYCLES] = 1;
+
+   for (int e = PERF_CYCLES + 1; e < PERF_COUNTERS; e++) {
+      if (perf_event(e, pc->fd) < 0) continue;
+      pc->event[pc->n++] = e;
+      pc->open[e] = 1;
+   }
+   ioctl(pc->fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Charges the counts since the previous mark to 'stage', -1: to nothing.
+static inline void perf_mark(perf_counters_t *pc, int stage)
+{
+   if (pc->fd < 0)
+      return;
+
+   // PERF_FORMAT_GROUP: nr, then one value per event in group order
+   uint64_t buf[1 + PERF_COUNTERS];
+   if (read(pc->fd, buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (1 + pc->n)))
+      return;
+
+   for (int i = 0; i < pc->n; i++) {
+      int e = pc->event[i];
+      if (stage >= 0 && stage < PERF_STAGES)
+         pc->sum[stage][e] += buf[1 + i] - pc->last[e];
+      pc->last[e] = buf[1 + i];
+   }
+   if (stage >= 0 && stage < PERF_STAGES)
+      pc->count[stage]++;
+}
+
+// Mean counts per stage since start; 'label' names the thread. Prints
+// nothing when the counters are off.
+static void perf_summary(const perf_counters_t *pc, const char *label,
+                         const char *const *names, int count, FILE *f)
+{
+   if (pc->fd < 0)
+      return;
+
+   static const char *const columns[PERF_COUNTERS] = {
+      "cycles", "instr", "L1D miss", "LLC miss", "br miss",
+   };
+   fprintf(f, "Perf counters per stage, user space, %s\n", label);
+   fprintf(f, "  %-24s %9s %12s %12s %5s %10s %10s %10s\n", "stage", "count",
+           columns[0], columns[1], "IPC", columns[2], columns[3], columns[4]);
+   for (int s = 0; s < count && s < PERF_STAGES; s++) {
+      if (!pc->count[s]) continue;
+      double mean[PERF_COUNTERS];
+      for (int e = 0; e < PERF_COUNTERS; e++)
+         mean[e] = (double)pc->sum[s][e] / pc->count[s];
+
+      fprintf(f, "  %-24s %9" PRIu64 " %12.0f", names[s], pc->count[s], mean[PERF_CYCLES]);
+      if (pc->open[PERF_INSTRUCTIONS])
+         fprintf(f, " %12.0f %5.2f", mean[PERF_INSTRUCTIONS],
+                 mean[PERF_CYCLES] > 0.0 ? mean[PERF_INSTRUCTIONS] / mean[PERF_CYCLES] : 0.0);
+      else
+         fprintf(f, " %12s %5s", "-", "-");
+      for (int e = PERF_L1D_MISSES; e < PERF_COUNTERS; e++) {
+         if (pc->open[e]) fprintf(f, " %10.0f", mean[e]);
+         else             fprintf(f, " %10s", "-");
+      }
+      fprintf(f, "\n");
+   }
+   fprintf(f, "\n");
+}
+
+#endif
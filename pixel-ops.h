@@ -0,0 +1,101 @@
+// pixel-ops.h
+// Wide fills and copies of 32-bit pixel rows for the CPU renderers.
+//
+// Rows are written with aligned 16/32/64 byte non-temporal stores (NEON
+// STNP on aarch64, SSE2/AVX streaming stores on x86), so a clear or a
+// shadow-to-scanout copy streams into write-combined scanout memory without
+// read-for-ownership traffic and without evicting the caches. Ragged row
+// starts and ends use plain stores. Call pixels_fence() once after a batch
+// of fills or copies, before the buffer is handed to the display.
+
+#ifndef PIXEL_OPS_H
+#define PIXEL_OPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define PIXELS_ALIGN 64
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define PIXELS_ALIGN 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXELS_ALIGN 16
+#else
+#define PIXELS_ALIGN 4
+#endif
+
+// dst[0..n) = argb
+static inline void pixels_fill(uint32_t *dst, uint32_t argb, size_t n)
+{
+   // scalar head up to the store alignment
+   while (n && ((uintptr_t)dst & (PIXELS_ALIGN - 1))) {
+      *dst++ = argb;
+      n--;
+   }
+
+#if defined(__aarch64__)
+   uint32x4_t v = vdupq_n_u32(argb);
+   for (; n >= 16; n -= 16, dst += 16)
+      __asm__ volatile("stnp %q1, %q1, [%0]\n\t"
+                       "stnp %q1, %q1, [%0, #32]"
+                       :: "r"(dst), "w"(v) : "memory");
+#elif defined(__AVX__)
+   __m256i v = _mm256_set1_epi32((int)argb);
+   for (; n >= 8; n -= 8, dst += 8)
+      _mm256_stream_si256((__m256i *)dst, v);
+#elif defined(__SSE2__)
+   __m128i v = _mm_set1_epi32((int)argb);
+   for (; n >= 4; n -= 4, dst += 4)
+      _mm_stream_si128((__m128i *)dst, v);
+#endif
+
+   while (n--)
+      *dst++ = argb;
+}
+
+// dst[0..n) = src[0..n); dst is what gets aligned, src may be unaligned
+static inline void pixels_copy(uint32_t *dst, const uint32_t *src, size_t n)
+{
+   while (n && ((uintptr_t)dst & (PIXELS_ALIGN - 1))) {
+      *dst++ = *src++;
+      n--;
+   }
+
+#if defined(__aarch64__)
+   for (; n >= 16; n -= 16, dst += 16, src += 16) {
+      uint32x4_t a = vld1q_u32(src);
+      uint32x4_t b = vld1q_u32(src + 4);
+      uint32x4_t c = vld1q_u32(src + 8);
+      uint32x4_t d = vld1q_u32(src + 12);
+      __asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+                       "stnp %q3, %q4, [%0, #32]"
+                       :: "r"(dst), "w"(a), "w"(b), "w"(c), "w"(d) : "memory");
+   }
+#elif defined(__AVX__)
+   for (; n >= 8; n -= 8, dst += 8, src += 8)
+      _mm256_stream_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+#elif defined(__SSE2__)
+   for (; n >= 4; n -= 4, dst += 4, src += 4)
+      _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#endif
+
+   while (n--)
+      *dst++ = *src++;
+}
+
+// orders the streaming stores above before whatever comes next
+static inline void pixels_fence(void)
+{
+#if defined(__aarch64__)
+   __asm__ volatile("dmb oshst" ::: "memory");
+#elif defined(__SSE2__)
+   _mm_sfence();
+#else
+   __asm__ volatile("" ::: "memory");
+#endif
+}
+
+#endif
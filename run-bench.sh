@@ -0,0 +1,95 @@
+#!/bin/bash
+
+# Runs every line renderer over the benchmark scenarios of bench.h and
+# collects the records on stdout, as one CSV table or one JSON array.
+#
+# usage: ./run-bench.sh [-B backend] [-f csv|json] [-w warmup] [-n frames] [scenario ...]
+#
+# Default: -B headless, csv, all scenarios. The programs are expected next to
+# this script, built as in gcc-commands. Renderers that cannot draw a
+# scenario (wide or antialiased lines) are skipped with a note on stderr.
+# ogl-line-perf2 has its draw call disabled and only measures generation,
+# upload and presentation, so it is not part of the default list.
+
+BACKEND="headless"
+FORMAT="csv"
+WARMUP=10
+FRAMES=100
+
+while getopts "B:f:w:n:" opt; do
+    case "$opt" in
+        B) BACKEND="$OPTARG" ;;
+        f) FORMAT="$OPTARG" ;;
+        w) WARMUP="$OPTARG" ;;
+        n) FRAMES="$OPTARG" ;;
+        *) echo "usage: $0 [-B backend] [-f csv|json] [-w warmup] [-n frames] [scenario ...]" >&2
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ "$FORMAT" != "csv" ] && [ "$FORMAT" != "json" ]; then
+    echo "format must be csv or json" >&2
+    exit 1
+fi
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+SCENARIOS="$*"
+if [ -z "$SCENARIOS" ]; then
+    SCENARIOS="random ecg ecg-wide ecg-aa span span-wide span-aa"
+fi
+
+# program and options, one renderer per line
+RENDERERS="
+kms-min -m direct
+kms-min -m shadow
+kms-min-mt
+ogl-min-line-perf
+ogl-line-perf -r gl
+ogl-line-perf -r compute
+ogl-triangle-line -m cpu
+ogl-triangle-line -m instanced
+"
+
+ERR=$(mktemp)
+trap 'rm -f "$ERR"' EXIT
+
+header=""
+first=1
+[ "$FORMAT" = "json" ] && echo "["
+
+for scenario in $SCENARIOS; do
+    while read -r program options; do
+        [ -z "$program" ] && continue
+        if [ ! -x "$DIR/$program" ]; then
+            echo "skipped $program: not built" >&2
+            continue
+        fi
+
+        out=$("$DIR/$program" $options -B "$BACKEND" \
+              -b "$scenario:warmup=$WARMUP:frames=$FRAMES:$FORMAT" < /dev/null 2> "$ERR")
+        status=$?
+        if [ $status -eq 2 ]; then
+            echo "skipped $program${options:+ $options}: $scenario not supported" >&2
+            continue
+        elif [ $status -ne 0 ]; then
+            echo "failed $program${options:+ $options} $scenario (status $status)" >&2
+            cat "$ERR" >&2
+            continue
+        fi
+
+        # the record is the last line (CSV: header before it), the program
+        # prints its usual startup lines before that
+        if [ "$FORMAT" = "json" ]; then
+            [ $first -eq 0 ] && echo ","
+            echo "$out" | tail -n 1
+        else
+            [ -z "$header" ] && header=$(echo "$out" | tail -n 2 | head -n 1) && echo "$header"
+            echo "$out" | tail -n 1
+        fi
+        first=0
+    done <<< "$RENDERERS"
+done
+
+[ "$FORMAT" = "json" ] && echo "]"
+exit 0
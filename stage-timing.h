@@ -0,0 +1,236 @@
+// stage-timing.h
+// Per-stage frame timing without printf in the render loop.
+//
+// The render loops take get_seconds() timestamps between their stages
+// (generate, clear, draw, flip, ...) anyway. stage_record() turns each pair
+// into one entry of a log-linear histogram for the stage (16 linear steps
+// per power of two of nanoseconds, so any latency from 1 ns to hours is
+// kept with about 6% resolution in 4 KB) and one event in a preallocated
+// ring of the last STAGE_EVENTS stages. Nothing is allocated or printed per
+// frame, so the loops run at full speed and every frame is counted.
+//
+// stage_poll() once per frame prints the summary (count, min, mean, p50,
+// p90, p99, p99.9, max per stage, since start):
+//   - every STAGE_REPORT seconds from the environment (default 10, 0: never)
+//   - on SIGUSR1, e.g. kill -USR1 $(pidof ogl-ecg) after hours of running
+// SIGINT and SIGTERM end the loop; stage_finish() then prints the summary
+// once more and, with STAGE_TRACE=file.json in the environment, writes the
+// ring as Chrome trace events (chrome://tracing, ui.perfetto.dev). A second
+// Ctrl-C kills the program the usual way.
+//
+// stage_record() must be called from one thread; workers hand their
+// timestamps to the main thread, which records them with their thread index.
+
+#ifndef STAGE_TIMING_H
+#define STAGE_TIMING_H
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STAGE_MAX 16
+#define STAGE_BUCKETS 1024
+#define STAGE_EVENTS 65536    // power of two
+
+enum { STAGE_RUN, STAGE_REPORT, STAGE_STOP };
+
+typedef struct {
+   const char *name;
+   uint64_t count;
+   uint64_t min_ns;
+   uint64_t max_ns;
+   double sum_ns;
+   uint32_t buckets[STAGE_BUCKETS];
+} stage_hist_t;
+
+typedef struct {
+   uint64_t start_ns;   // since stage_init()
+   uint32_t dur_ns;
+   uint16_t stage;
+   uint16_t thread;
+} stage_event_t;
+
+typedef struct {
+   int count;
+   stage_hist_t hist[STAGE_MAX];
+   stage_event_t *events;     // ring of the last STAGE_EVENTS stages
+   uint64_t written;
+   double t_start;
+   double t_report;           // time of the last summary
+   double interval;           // seconds between summaries, 0: on signal only
+   const char *trace_path;
+} stage_timer_t;
+
+static volatile sig_atomic_t stage_report_requested;
+static volatile sig_atomic_t stage_stop_requested;
+
+static void stage_signal(int sig)
+{
+   if (sig == SIGUSR1) stage_report_requested = 1;
+   else                stage_stop_requested = 1;
+}
+
+static inline double stage_seconds(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Histogram bucket of a duration: exact below 16 ns, then 16 steps per
+// power of two.
+static inline int stage_bucket(uint64_t ns)
+{
+   if (ns < 16) return (int)ns;
+   int e = 63 - __builtin_clzll(ns);
+   return ((e - 3) << 4) | (int)((ns >> (e - 4)) & 15);
+}
+
+// smallest duration in bucket b
+static inline uint64_t stage_bucket_low(int b)
+{
+   if (b < 16) return (uint64_t)b;
+   int e = (b >> 4) + 3;
+   return (uint64_t)(16 | (b & 15)) << (e - 4);
+}
+
+// Timer for 'count' stages named names[0..count). Installs the SIGUSR1,
+// SIGINT and SIGTERM handlers.
+static stage_timer_t *stage_init(const char *const *names, int count)
+{
+   stage_timer_t *st = calloc(1, sizeof(*st));
+   st->count = count < STAGE_MAX ? count : STAGE_MAX;
+   for (int i = 0; i < st->count; i++) {
+      st->hist[i].name = names[i];
+      st->hist[i].min_ns = UINT64_MAX;
+   }
+   st->events = calloc(STAGE_EVENTS, sizeof(stage_event_t));
+   st->t_start = st->t_report = stage_seconds();
+
+   const char *env = getenv("STAGE_REPORT");
+   st->interval = env ? strtod(env, NULL) : 10.0;
+   st->trace_path = getenv("STAGE_TRACE");
+
+   // no SA_RESTART: a blocking select() or sleep() returns early instead
+   struct sigaction sa = { .sa_handler = stage_signal };
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGUSR1, &sa, NULL);
+   sa.sa_flags = SA_RESETHAND;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   return st;
+}
+
+// Stage 'stage' of thread 'thread' ran from t0 to t1 (get_seconds() values).
+static inline void stage_record(stage_timer_t *st, int stage, int thread, double t0, double t1)
+{
+   double d = (t1 - t0) * 1e9;
+   uint64_t ns = d > 0.0 ? (uint64_t)d : 0;
+
+   stage_hist_t *h = &st->hist[stage];
+   h->count++;
+   h->sum_ns += (double)ns;
+   if (ns < h->min_ns) h->min_ns = ns;
+   if (ns > h->max_ns) h->max_ns = ns;
+   h->buckets[stage_bucket(ns)]++;
+
+   stage_event_t *e = &st->events[st->written++ & (STAGE_EVENTS - 1)];
+   double start = (t0 - st->t_start) * 1e9;
+   e->start_ns = start > 0.0 ? (uint64_t)start : 0;
+   e->dur_ns = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+   e->stage = (uint16_t)stage;
+   e->thread = (uint16_t)thread;
+}
+
+// Duration below which a fraction q of the samples lie, in nanoseconds: the
+// middle of its bucket, clamped to the exact min and max.
+static uint64_t stage_percentile(const stage_hist_t *h, double q)
+{
+   uint64_t rank = (uint64_t)(q * (double)h->count + 0.999999);
+   if (rank < 1) rank = 1;
+   uint64_t seen = 0;
+   for (int b = 0; b < STAGE_BUCKETS; b++) {
+      seen += h->buckets[b];
+      if (seen < rank) continue;
+      uint64_t lo = stage_bucket_low(b);
+      uint64_t v = lo + (stage_bucket_low(b + 1) - lo) / 2;
+      if (v < h->min_ns) v = h->min_ns;
+      if (v > h->max_ns) v = h->max_ns;
+      return v;
+   }
+   return h->max_ns;
+}
+
+static void stage_summary(const stage_timer_t *st, FILE *f)
+{
+   fprintf(f, "Stage times in ms, %.1f sec since start\n", stage_seconds() - st->t_start);
+   fprintf(f, "  %-24s %9s %8s %8s %8s %8s %8s %8s %8s\n", "stage", "count",
+           "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+   for (int i = 0; i < st->count; i++) {
+      const stage_hist_t *h = &st->hist[i];
+      if (!h->count) continue;
+      fprintf(f, "  %-24s %9" PRIu64 " %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+              h->name, h->count, h->min_ns * 1e-6, h->sum_ns / h->count * 1e-6,
+              stage_percentile(h, 0.50) * 1e-6, stage_percentile(h, 0.90) * 1e-6,
+              stage_percentile(h, 0.99) * 1e-6, stage_percentile(h, 0.999) * 1e-6,
+              h->max_ns * 1e-6);
+   }
+   fprintf(f, "\n");
+   fflush(f);
+}
+
+// Call once per frame. Prints the summary when one is due and returns
+// STAGE_REPORT, so the caller can add its own lines; STAGE_STOP after
+// SIGINT or SIGTERM.
+static int stage_poll(stage_timer_t *st)
+{
+   if (stage_stop_requested)
+      return STAGE_STOP;
+
+   double now = stage_seconds();
+   if (!stage_report_requested && (st->interval <= 0.0 || now - st->t_report < st->interval))
+      return STAGE_RUN;
+
+   stage_report_requested = 0;
+   st->t_report = now;
+   stage_summary(st, stdout);
+   return STAGE_REPORT;
+}
+
+// Chrome trace event format: one complete ("X") event per ring entry,
+// timestamps in microseconds.
+static int stage_write_trace(const stage_timer_t *st, const char *path)
+{
+   FILE *f = fopen(path, "w");
+   if (!f) return 0;
+
+   uint64_t n = st->written < STAGE_EVENTS ? st->written : STAGE_EVENTS;
+   fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   for (uint64_t i = st->written - n; i < st->written; i++) {
+      const stage_event_t *e = &st->events[i & (STAGE_EVENTS - 1)];
+      fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                 "\"ts\": %.3f, \"dur\": %.3f}%s\n",
+              st->hist[e->stage].name, e->thread,
+              e->start_ns * 1e-3, e->dur_ns * 1e-3, i + 1 < st->written ? "," : "");
+   }
+   fprintf(f, "]}\n");
+   return fclose(f) == 0;
+}
+
+// Final summary, and the trace file if STAGE_TRACE is set.
+static void stage_finish(stage_timer_t *st)
+{
+   stage_summary(st, stdout);
+   if (st->trace_path) {
+      if (stage_write_trace(st, st->trace_path))
+         printf("Trace      : %s\n", st->trace_path);
+      else
+         perror(st->trace_path);
+   }
+}
+
+#endif
@@ -0,0 +1,100 @@
+// vertex-ring.h
+// Streaming vertex buffer for the GLES3 line benchmarks.
+//
+// Orphaning the VBO with glBufferData() and uploading with glBufferSubData()
+// writes every vertex twice (malloc'd array, then the driver's copy) and
+// lets the driver allocate a new buffer each frame. Instead one VBO is split
+// into VERTEX_RING_FRAMES regions; each frame maps its region unsynchronized
+// and the generator writes straight into it. A fence after the frame's draw
+// call keeps the CPU from overwriting a region the GPU still reads.
+//
+// GLES 3.0 has no persistent mappings (GL_EXT_buffer_storage), so the
+// region is mapped and unmapped per frame; with the unsynchronized bit that
+// is cheap and never waits for the GPU.
+
+#ifndef VERTEX_RING_H
+#define VERTEX_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <GLES3/gl3.h>
+
+#define VERTEX_RING_FRAMES 3
+
+typedef struct {
+    size_t frame_size;                  // bytes per region
+    int current;                        // region of the frame being built
+    GLsync fence[VERTEX_RING_FRAMES];   // signalled when the GPU is done with a region
+    uint32_t stalls;                    // frames that had to wait for a fence
+    double wait_time;                   // seconds spent waiting, since the last reset
+} vertex_ring_t;
+
+// Allocates the regions in the buffer bound to GL_ARRAY_BUFFER. Regions
+// are rounded up to 256 bytes, the largest offset alignment GLES allows
+// for shader storage ranges, so a region can also be bound as an SSBO.
+static inline void vertex_ring_init(vertex_ring_t *ring, size_t frame_size)
+{
+    frame_size = (frame_size + 255) & ~(size_t)255;
+    *ring = (vertex_ring_t){ .frame_size = frame_size, .current = -1 };
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(frame_size * VERTEX_RING_FRAMES),
+                 NULL, GL_DYNAMIC_DRAW);
+}
+
+// Maps the next region for writing, waiting for the GPU only if it still
+// reads from it. The region is vertex_ring_first(ring, stride) vertices into
+// the buffer, so the attribute pointers never change.
+static inline void *vertex_ring_begin(vertex_ring_t *ring)
+{
+    ring->current = (ring->current + 1) % VERTEX_RING_FRAMES;
+
+    GLsync fence = ring->fence[ring->current];
+    if (fence) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            struct timespec a, b;
+            clock_gettime(CLOCK_MONOTONIC, &a);
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                    100000000) == GL_TIMEOUT_EXPIRED)
+                ;
+            clock_gettime(CLOCK_MONOTONIC, &b);
+            ring->wait_time += (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) * 1e-9;
+            ring->stalls++;
+        }
+        glDeleteSync(fence);
+        ring->fence[ring->current] = 0;
+    }
+
+    return glMapBufferRange(GL_ARRAY_BUFFER,
+                            (GLintptr)(ring->frame_size * ring->current),
+                            (GLsizeiptr)ring->frame_size,
+                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                            GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+// Unmaps the region; call before drawing from it.
+static inline void vertex_ring_end(vertex_ring_t *ring)
+{
+    (void)ring;
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+// First vertex of the current region for glDrawArrays(); stride must
+// divide 256.
+static inline GLint vertex_ring_first(const vertex_ring_t *ring, size_t stride)
+{
+    return (GLint)(ring->frame_size * ring->current / stride);
+}
+
+// Byte offset of the current region, e.g. for glBindBufferRange().
+static inline GLintptr vertex_ring_offset(const vertex_ring_t *ring)
+{
+    return (GLintptr)(ring->frame_size * ring->current);
+}
+
+// Fences the current region after the draw calls that read it.
+static inline void vertex_ring_fence(vertex_ring_t *ring)
+{
+    ring->fence[ring->current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+#endif